@@ -6,7 +6,84 @@
  */
 
 #include <student/gpu.hpp>
+#include <cstring>
+#include <limits>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GPU_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GPU_TARGET_SSE
+#define GPU_TARGET_AVX
+#else
+#define GPU_TARGET_SSE __attribute__((target("sse2")))
+#define GPU_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+static GPU::CoverageKernel selectCoverageKernel();
+
+const uint32_t GPU::noSlot;
+const size_t GPU::DrawArena::blockBytes;
+
+//tolerance of hierarchical z tests, covers rounding of interpolated depth
+static const float hizEpsilon = 1e-5f;
+
+//sample positions relative to pixel center (standard 4x and 8x patterns, in 1/16 of pixel)
+struct SampleOffset {
+    float x;
+    float y;
+};
+static const SampleOffset samplePattern1[1] = { { 0.f, 0.f } };
+static const SampleOffset samplePattern4[4] = {
+    { -2 / 16.f, -6 / 16.f }, { 6 / 16.f, -2 / 16.f }, { -6 / 16.f, 2 / 16.f }, { 2 / 16.f, 6 / 16.f } };
+static const SampleOffset samplePattern8[8] = {
+    { 1 / 16.f, -3 / 16.f }, { -1 / 16.f, 3 / 16.f }, { 5 / 16.f, 1 / 16.f }, { -3 / 16.f, -5 / 16.f },
+    { -5 / 16.f, 5 / 16.f }, { -7 / 16.f, -1 / 16.f }, { 3 / 16.f, 7 / 16.f }, { 7 / 16.f, -7 / 16.f } };
+
+/* @brief Function returns sample positions for number of samples of framebuffer.
+ */
+static SampleOffset const* samplePattern(uint32_t samples) {
+    if (samples == 8) return samplePattern8;
+    if (samples == 4) return samplePattern4;
+    return samplePattern1;
+}
+
+/* @brief Function fills count 32-bit values. On x86-64 non-temporal stores are used,
+   so clear of whole buffer doesn't pull it through the cache, streamFence has to follow.
+ */
+static void streamFill(uint32_t* dst, uint32_t value, size_t count) {
+#if defined(__x86_64__) || defined(_M_X64)
+    //scalar stores until dst is 16 byte aligned
+    while (count > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = value;
+        count--;
+    }
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; count >= 4; count -= 4, dst += 4) _mm_stream_si128((__m128i*)dst, v);
+#endif
+    std::fill_n(dst, count, value);
+}
 
+/* @brief Function orders non-temporal stores of streamFill before any later stores.
+ */
+static void streamFence() {
+#if defined(__x86_64__) || defined(_M_X64)
+    _mm_sfence();
+#endif
+}
 
 
 /// \addtogroup gpu_init
@@ -17,10 +94,21 @@
  */
 GPU::GPU(){
   /// \todo Zde můžete alokovat/inicializovat potřebné proměnné grafické karty
-    nextFreeID = 0;
     currVertexPuller = nullptr;
     currProgram = nullptr;
-    currFrameBuffer = nullptr;
+    currFrameBuffer = &defaultFrameBuffer;
+    swapImages.resize(1);
+    nextPresentID = 0;
+    tilesX = 0;
+    tilesY = 0;
+    guardBand = 16.f;
+    lazyClear = false;
+    cullFace = CullFace::NONE;
+    frontFace = FrontFace::CCW;
+    smallPrimitiveCulling = true;
+    coverageKernel = selectCoverageKernel();
+    uint32_t cores = std::thread::hardware_concurrency();
+    pool.start(cores > 1 ? cores - 1 : 0);
 }
 
 /**
@@ -28,6 +116,7 @@ GPU::GPU(){
  */
 GPU::~GPU(){
   /// \todo Zde můžete dealokovat/deinicializovat grafickou kartu
+    pool.finish();
 }
 
 /// @}
@@ -48,18 +137,92 @@ BufferID GPU::createBuffer(uint64_t size) {
   /// Velikost bufferu je v parameteru size (v bajtech).<br>
   /// Funkce by měla vrátit unikátní identifikátor identifikátor bufferu.<br>
   /// Na grafické kartě by mělo být možné alkovat libovolné množství bufferů o libovolné velikosti.<br>
-    BufferID id = emptyID;
-    if (freeIDs.empty()) {
-        id = nextFreeID;
-        nextFreeID++;
+    BufferID id = buffers.create();
+    buffers.find(id)->data.resize(size_t(size));
+    return id; 
+}
+
+/* @brief Function maps size bytes of file from offset read-only (size 0 maps rest of file),
+   bytes and mapped_size are set to mapped range. Mapping starts at page boundary and is
+   unmapped when last reference to returned pointer is released, nullptr if mapping failed.
+ */
+static std::shared_ptr<void> mapFile(char const* path, uint64_t offset, uint64_t size, uint8_t*& bytes, uint64_t& mapped_size) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || offset >= uint64_t(file_size.QuadPart)) {
+        CloseHandle(file);
+        return nullptr;
     }
-    else {
-        id = freeIDs.front();
-        freeIDs.pop_front();
+    uint64_t available = uint64_t(file_size.QuadPart) - offset;
+    if (size == 0) size = available;
+    if (size > available) {
+        CloseHandle(file);
+        return nullptr;
     }
-    auto buffer = std::vector<uint8_t>(size_t(size));
-    buffers.emplace(id, move(buffer));
-    return id; 
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);    //mapping keeps file open
+    if (mapping == nullptr) return nullptr;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint64_t start = offset / info.dwAllocationGranularity * info.dwAllocationGranularity;
+    void* base = MapViewOfFile(mapping, FILE_MAP_READ, DWORD(start >> 32), DWORD(start), SIZE_T(offset - start + size));
+    CloseHandle(mapping);    //view keeps mapping alive
+    if (base == nullptr) return nullptr;
+    bytes = (uint8_t*)base + (offset - start);
+    mapped_size = size;
+    return std::shared_ptr<void>(base, [](void* view) { UnmapViewOfFile(view); });
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || offset >= uint64_t(info.st_size)) {
+        close(fd);
+        return nullptr;
+    }
+    uint64_t available = uint64_t(info.st_size) - offset;
+    if (size == 0) size = available;
+    if (size > available) {
+        close(fd);
+        return nullptr;
+    }
+    uint64_t page = uint64_t(sysconf(_SC_PAGESIZE));
+    uint64_t start = offset / page * page;
+    size_t length = size_t(offset - start + size);
+    void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, off_t(start));
+    close(fd);    //mapping keeps file open
+    if (base == MAP_FAILED) return nullptr;
+    bytes = (uint8_t*)base + (offset - start);
+    mapped_size = size;
+    return std::shared_ptr<void>(base, [length](void* view) { munmap(view, length); });
+#endif
+}
+
+/**
+ * @brief This function creates read-only buffer backed by memory mapped file.
+ * Data are paged in lazily when vertex puller reads them and page cache is shared
+ * with other processes mapping the same file. setBufferData and mapBuffer with WRITE
+ * access are ignored for such buffer.
+ *
+ * @param path path to the file
+ * @param offset offset of buffer data in the file in bytes
+ * @param size size of buffer in bytes, 0 uses rest of the file
+ *
+ * @return unique identificator of the buffer, emptyID if file can not be mapped
+ */
+BufferID GPU::createBufferFromFile(char const* path, uint64_t offset, uint64_t size) {
+    uint8_t* bytes = nullptr;
+    uint64_t mapped_size = 0;
+    std::shared_ptr<void> file = mapFile(path, offset, size, bytes, mapped_size);
+    if (!file) return emptyID;
+
+    BufferID id = buffers.create();
+    Buffer* buffer = buffers.find(id);
+    buffer->file = file;
+    buffer->file_bytes = bytes;
+    buffer->file_size = mapped_size;
+    return id;
 }
 
 /**
@@ -71,12 +234,7 @@ void GPU::deleteBuffer(BufferID buffer) {
   /// \todo Tato funkce uvolní buffer na grafické kartě.
   /// Buffer pro smazání je vybrán identifikátorem v parameteru "buffer".
   /// Po uvolnění bufferu je identifikátor volný a může být znovu použit při vytvoření nového bufferu.
-    auto it = buffers.find(buffer);
-    if (it != buffers.end()) {
-        BufferID removedID = it->first;
-        freeIDs.push_back(removedID);
-        buffers.erase(it);
-    }
+    buffers.erase(buffer);
 }
 
 /**
@@ -93,9 +251,9 @@ void GPU::setBufferData(BufferID buffer, uint64_t offset, uint64_t size, void co
   /// Parametr size určuje, kolik dat (v bajtech) se překopíruje.<br>
   /// Parametr offset určuje místo v bufferu (posun v bajtech) kam se data nakopírují.<br>
   /// Parametr data obsahuje ukazatel na data na cpu pro kopírování.<br>
-    auto it = buffers.find(buffer);
-    if (it != buffers.end()) {
-        std::copy((uint8_t*) data, (uint8_t*) data + size, it->second.begin() + offset);
+    Buffer* storage = buffers.find(buffer);
+    if (storage != nullptr && storage->usable() && !storage->read_only()) {
+        std::copy((uint8_t*) data, (uint8_t*) data + size, storage->bytes() + offset);
     }
 }
 
@@ -117,9 +275,9 @@ void GPU::getBufferData(BufferID buffer,
   /// Parametr size určuje kolik dat (v bajtech) se překopíruje.<br>
   /// Parametr offset určuje místo v bufferu (posun v bajtech) odkud se začne kopírovat.<br>
   /// Parametr data obsahuje ukazatel, kam se data nakopírují.
-    auto it = buffers.find(buffer);
-    if (it != buffers.end()) {
-        std::copy(it->second.begin() + offset, it->second.begin() + offset + size, (uint8_t*)data);
+    Buffer* storage = buffers.find(buffer);
+    if (storage != nullptr && storage->usable()) {
+        std::copy(storage->bytes() + offset, storage->bytes() + offset + size, (uint8_t*)data);
     }
 }
 
@@ -134,8 +292,49 @@ bool GPU::isBuffer(BufferID buffer) {
   /// \todo Tato funkce by měla vrátit true pokud buffer je identifikátor existující bufferu.<br>
   /// Tato funkce by měla vrátit false, pokud buffer není identifikátor existujícího bufferu. (nebo bufferu, který byl smazán).<br>
   /// Pro emptyId vrací false.<br>
-    if (buffers.find(buffer) != buffers.end()) return true;
-    else return false; 
+    return buffers.find(buffer) != nullptr;
+}
+
+/**
+ * @brief This function maps range of buffer to CPU address space.
+ * Returned pointer points directly to buffer storage, so data can be written or read without copying.
+ * Drawing is synchronous, so with PERSISTENT access the pointer can be used between draw calls
+ * while buffer stays mapped. Deleting buffer unmaps it.
+ *
+ * @param buffer buffer identificator
+ * @param offset specifies the offset into the buffer's data
+ * @param size specifies the size of mapped range
+ * @param access READ, WRITE or READ_WRITE, optionally combined with PERSISTENT
+ *
+ * @return pointer to first byte of mapped range, nullptr if buffer does not exist,
+ * is already mapped, range is outside of buffer or WRITE is requested for file-backed buffer
+ */
+void* GPU::mapBuffer(BufferID buffer, uint64_t offset, uint64_t size, MapAccess access) {
+    Buffer* storage = buffers.find(buffer);
+    if (storage == nullptr || storage->mapped) return nullptr;
+    if (storage->read_only() && hasAccess(access, MapAccess::WRITE)) return nullptr;
+    if (offset > storage->size() || size > storage->size() - offset) return nullptr;
+    storage->mapped = true;
+    storage->map_access = access;
+    storage->map_offset = offset;
+    storage->map_size = size;
+    return storage->bytes() + offset;
+}
+
+/**
+ * @brief This function unmaps buffer mapped by mapBuffer, pointer returned by mapBuffer becomes invalid.
+ *
+ * @param buffer buffer identificator
+ *
+ * @return true if buffer was mapped
+ */
+bool GPU::unmapBuffer(BufferID buffer) {
+    Buffer* storage = buffers.find(buffer);
+    if (storage == nullptr || !storage->mapped) return false;
+    storage->mapped = false;
+    storage->map_offset = 0;
+    storage->map_size = 0;
+    return true;
 }
 
 /// @}
@@ -154,20 +353,7 @@ ObjectID GPU::createVertexPuller     (){
   /// \todo Tato funkce vytvoří novou práznou tabulku s nastavením pro vertex puller.<br>
   /// Funkce by měla vrátit identifikátor nové tabulky.
   /// Prázdná tabulka s nastavením neobsahuje indexování a všechny čtecí hlavy jsou vypnuté.
-    VertexPullerID id = emptyID;
-    if (freeIDs.empty()) {
-        id = nextFreeID;
-        nextFreeID++;
-    }
-    else {
-        id = freeIDs.front();
-        freeIDs.pop_front();
-    }
-
-    auto vertex = VertexPuller();
-    vertexPullers.emplace(id, vertex);
-
-    return id;
+    return vertexPullers.create();
 }
 
 /**
@@ -179,11 +365,10 @@ void     GPU::deleteVertexPuller     (VertexPullerID vao){
   /// \todo Tato funkce by měla odstranit tabulku s nastavení pro vertex puller.<br>
   /// Parameter "vao" obsahuje identifikátor tabulky s nastavením.<br>
   /// Po uvolnění nastavení je identifiktátor volný a může být znovu použit.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        VertexPullerID removedID = it->first;
-        freeIDs.push_back(removedID);
-        vertexPullers.erase(it);
+    VertexPuller* puller = vertexPullers.find(vao);
+    if (puller != nullptr) {
+        if (currVertexPuller == puller) currVertexPuller = nullptr;
+        vertexPullers.erase(vao);
     }
 }
 
@@ -196,8 +381,9 @@ void     GPU::deleteVertexPuller     (VertexPullerID vao){
  * @param stride stride in bytes
  * @param offset offset in bytes
  * @param buffer id of buffer
+ * @param divisor 0 reads attribute per vertex, n > 0 reads it per instance, advancing every n instances
  */
-void     GPU::setVertexPullerHead    (VertexPullerID vao,uint32_t head,AttributeType type,uint64_t stride,uint64_t offset,BufferID buffer){
+void     GPU::setVertexPullerHead    (VertexPullerID vao,uint32_t head,AttributeType type,uint64_t stride,uint64_t offset,BufferID buffer,uint32_t divisor){
   /// \todo Tato funkce nastaví jednu čtecí hlavu vertex pulleru.<br>
   /// Parametr "vao" vybírá tabulku s nastavením.<br>
   /// Parametr "head" vybírá čtecí hlavu vybraného vertex pulleru.<br>
@@ -205,12 +391,13 @@ void     GPU::setVertexPullerHead    (VertexPullerID vao,uint32_t head,Attribute
   /// Parametr "stride" nastaví krok čtecí hlavy.<br>
   /// Parametr "offset" nastaví počáteční pozici čtecí hlavy.<br>
   /// Parametr "buffer" vybere buffer, ze kterého bude čtecí hlava číst.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        it->second.heads[head].buffer = buffer;
-        it->second.heads[head].offset = offset;
-        it->second.heads[head].stride = stride;
-        it->second.heads[head].type = type;
+    VertexPuller* puller = vertexPullers.find(vao);
+    if (puller != nullptr) {
+        puller->heads[head].buffer = buffer;
+        puller->heads[head].offset = offset;
+        puller->heads[head].stride = stride;
+        puller->heads[head].type = type;
+        puller->heads[head].divisor = divisor;
     }
 }
 
@@ -226,11 +413,11 @@ void     GPU::setVertexPullerIndexing(VertexPullerID vao,IndexType type,BufferID
   /// Parametr "vao" vybírá tabulku s nastavením.<br>
   /// Parametr "type" volí typ indexu, který je uložený v bufferu.<br>
   /// Parametr "buffer" volí buffer, ve kterém jsou uloženy indexy.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        it->second.indexing = true;
-        it->second.index_type = type;
-        it->second.index_buffer = buffer;
+    VertexPuller* puller = vertexPullers.find(vao);
+    if (puller != nullptr) {
+        puller->indexing = true;
+        puller->index_type = type;
+        puller->index_buffer = buffer;
     }
 }
 
@@ -245,9 +432,9 @@ void     GPU::enableVertexPullerHead (VertexPullerID vao,uint32_t head){
   /// Pokud je čtecí hlava povolena, hodnoty z bufferu se budou kopírovat do atributu vrcholů vertex shaderu.<br>
   /// Parametr "vao" volí tabulku s nastavením vertex pulleru (vybírá vertex puller).<br>
   /// Parametr "head" volí čtecí hlavu.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        it->second.heads[head].enabled = true;
+    VertexPuller* puller = vertexPullers.find(vao);
+    if (puller != nullptr) {
+        puller->heads[head].enabled = true;
     }
 }
 
@@ -261,9 +448,9 @@ void     GPU::disableVertexPullerHead(VertexPullerID vao,uint32_t head){
   /// \todo Tato funkce zakáže čtecí hlavu daného vertex pulleru.<br>
   /// Pokud je čtecí hlava zakázána, hodnoty z bufferu se nebudou kopírovat do atributu vrcholu.<br>
   /// Parametry "vao" a "head" vybírají vertex puller a čtecí hlavu.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        it->second.heads[head].enabled = false;
+    VertexPuller* puller = vertexPullers.find(vao);
+    if (puller != nullptr) {
+        puller->heads[head].enabled = false;
     }
 }
 
@@ -275,11 +462,7 @@ void     GPU::disableVertexPullerHead(VertexPullerID vao,uint32_t head){
 void     GPU::bindVertexPuller       (VertexPullerID vao){
   /// \todo Tato funkce aktivuje nastavení vertex pulleru.<br>
   /// Pokud je daný vertex puller aktivován, atributy z bufferů jsou vybírány na základě jeho nastavení.<br>
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) {
-        currVertexPuller = &vertexPullers[vao];
-    }
-    else currVertexPuller = nullptr;
+    currVertexPuller = vertexPullers.find(vao);
 }
 
 /**
@@ -301,9 +484,7 @@ void     GPU::unbindVertexPuller     (){
 bool     GPU::isVertexPuller         (VertexPullerID vao){
   /// \todo Tato funkce otestuje, zda daný vertex puller existuje.
   /// Pokud ano, funkce vrací true.
-    auto it = vertexPullers.find(vao);
-    if (it != vertexPullers.end()) return true;
-    else return false;
+    return vertexPullers.find(vao) != nullptr;
 }
 
 /// @}
@@ -322,20 +503,7 @@ ProgramID        GPU::createProgram         (){
   /// Funkce vrací unikátní identifikátor nového proramu.<br>
   /// Program je seznam nastavení, které obsahuje: ukazatel na vertex a fragment shader.<br>
   /// Dále obsahuje uniformní proměnné a typ výstupních vertex attributů z vertex shaderu, které jsou použity pro interpolaci do fragment atributů.<br>
-    ProgramID id = emptyID;
-    if (freeIDs.empty()) {
-        id = nextFreeID;
-        nextFreeID++;
-    }
-    else {
-        id = freeIDs.front();
-        freeIDs.pop_front();
-    }
-
-    auto program = Program();
-    programs.emplace(id, program);
-
-    return id;
+    return programs.create();
 }
 
 /**
@@ -347,11 +515,10 @@ void             GPU::deleteProgram         (ProgramID prg){
   /// \todo Tato funkce by měla smazat vybraný shader program.<br>
   /// Funkce smaže nastavení shader programu.<br>
   /// Identifikátor programu se stane volným a může být znovu využit.<br>
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        ProgramID removedID = it->first;
-        freeIDs.push_back(removedID);
-        programs.erase(it);
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        if (currProgram == program) currProgram = nullptr;
+        programs.erase(prg);
     }
 }
 
@@ -364,9 +531,37 @@ void             GPU::deleteProgram         (ProgramID prg){
  */
 void             GPU::attachShaders         (ProgramID prg,VertexShader vs,FragmentShader fs){
   /// \todo Tato funkce by měla připojít k vybranému shader programu vertex a fragment shader.
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.attachShaders(vs, fs);
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->attachShaders(vs, fs);
+    }
+}
+
+/**
+ * @brief This function attaches batched vertex shader to shader program.
+ * When program has one, it is used instead of the scalar vertex shader.
+ *
+ * @param prg shader program
+ * @param vs batched vertex shader (nullptr to go back to the scalar one)
+ */
+void             GPU::attachBatchVertexShader(ProgramID prg,BatchVertexShader vs){
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->batch_vertex_shader = vs;
+    }
+}
+
+/**
+ * @brief This function attaches fragment shader with several outputs to shader program.
+ * It is used instead of fragment shader from attachShaders, gl_FragData[i] is written to color attachment i.
+ *
+ * @param prg shader program
+ * @param fs fragment shader writing gl_FragData (nullptr to use fragment shader again)
+ */
+void             GPU::attachFragmentDataShader(ProgramID prg,FragmentDataShader fs){
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->fragment_data_shader = fs;
     }
 }
 
@@ -384,9 +579,9 @@ void             GPU::setVS2FSType          (ProgramID prg,uint32_t attrib,Attri
   /// Tyto atributy obsahují interpolované hodnoty vertex atributů.<br>
   /// Tato funkce vybere jakého typu jsou tyto interpolované atributy.<br>
   /// Bez jakéhokoliv nastavení jsou atributy prázdne AttributeType::EMPTY<br>
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.types[attrib] = type;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->types[attrib] = type;
     }
 }
 
@@ -397,9 +592,9 @@ void             GPU::setVS2FSType          (ProgramID prg,uint32_t attrib,Attri
  */
 void             GPU::useProgram            (ProgramID prg){
   /// \todo tato funkce by měla vybrat aktivní shader program.
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        currProgram = &(it->second);
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        currProgram = program;
     }
 }
 
@@ -413,8 +608,7 @@ void             GPU::useProgram            (ProgramID prg){
 bool             GPU::isProgram             (ProgramID prg){
   /// \todo tato funkce by měla zjistit, zda daný program existuje.<br>
   /// Funkce vráti true, pokud program existuje.<br>
-    auto it = programs.find(prg);
-    if (it != programs.end()) return true;
+    if (programs.find(prg) != nullptr) return true;
     else return false;
 }
 
@@ -430,9 +624,9 @@ void             GPU::programUniform1f      (ProgramID prg,uint32_t uniformId,fl
   /// Parametr "prg" vybírá shader program.<br>
   /// Parametr "uniformId" vybírá uniformní proměnnou. Maximální počet uniformních proměnných je uložen v programné \link maxUniforms \endlink.<br>
   /// Parametr "d" obsahuje data (1 float).<br>
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.uniforms.uniform[uniformId].v1 = d;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->uniforms.uniform[uniformId].v1 = d;
     }
 }
 
@@ -446,9 +640,9 @@ void             GPU::programUniform1f      (ProgramID prg,uint32_t uniformId,fl
 void             GPU::programUniform2f      (ProgramID prg,uint32_t uniformId,glm::vec2 const&d){
   /// \todo tato funkce dělá obdobnou věc jako funkce programUniform1f.<br>
   /// Místo 1 floatu nahrává 2 floaty.
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.uniforms.uniform[uniformId].v2 = d;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->uniforms.uniform[uniformId].v2 = d;
     }
 }
 
@@ -462,9 +656,9 @@ void             GPU::programUniform2f      (ProgramID prg,uint32_t uniformId,gl
 void             GPU::programUniform3f      (ProgramID prg,uint32_t uniformId,glm::vec3 const&d){
   /// \todo tato funkce dělá obdobnou věc jako funkce programUniform1f.<br>
   /// Místo 1 floatu nahrává 3 floaty.
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.uniforms.uniform[uniformId].v3 = d;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->uniforms.uniform[uniformId].v3 = d;
     }
 }
 
@@ -478,9 +672,9 @@ void             GPU::programUniform3f      (ProgramID prg,uint32_t uniformId,gl
 void             GPU::programUniform4f      (ProgramID prg,uint32_t uniformId,glm::vec4 const&d){
   /// \todo tato funkce dělá obdobnou věc jako funkce programUniform1f.<br>
   /// Místo 1 floatu nahrává 4 floaty.
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.uniforms.uniform[uniformId].v4 = d;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->uniforms.uniform[uniformId].v4 = d;
     }
 }
 
@@ -494,9 +688,9 @@ void             GPU::programUniform4f      (ProgramID prg,uint32_t uniformId,gl
 void             GPU::programUniformMatrix4f(ProgramID prg,uint32_t uniformId,glm::mat4 const&d){
   /// \todo tato funkce dělá obdobnou věc jako funkce programUniform1f.<br>
   /// Místo 1 floatu nahrává matici 4x4 (16 floatů).
-    auto it = programs.find(prg);
-    if (it != programs.end()) {
-        it->second.uniforms.uniform[uniformId].m4 = d;
+    Program* program = programs.find(prg);
+    if (program != nullptr) {
+        program->uniforms.uniform[uniformId].m4 = d;
     }
 }
 
@@ -512,16 +706,18 @@ void             GPU::programUniformMatrix4f(ProgramID prg,uint32_t uniformId,gl
  *
  * @param width width of framebuffer
  * @param height height of framebuffer
+ * @param depth format of depth buffer
+ * @param color format of color buffer
  */
-void GPU::createFramebuffer      (uint32_t width,uint32_t height){
+void GPU::createFramebuffer      (uint32_t width,uint32_t height,DepthFormat depth,ColorFormat color){
   /// \todo Tato funkce by měla alokovat framebuffer od daném rozlišení.<br>
   /// Framebuffer se skládá z barevného a hloukového bufferu.<br>
   /// Buffery obsahují width x height pixelů.<br>
   /// Barevný pixel je složen z 4 x uint8_t hodnot - to reprezentuje RGBA barvu.<br>
   /// Hloubkový pixel obsahuje 1 x float - to reprezentuje hloubku.<br>
   /// Nultý pixel framebufferu je vlevo dole.
-    currFrameBuffer = new FrameBuffer();
-    currFrameBuffer->set_up(width, height);
+    defaultFrameBuffer = FrameBuffer();
+    defaultFrameBuffer.set_up(width, height, depth, 1, &color);
 }
 
 /**
@@ -529,7 +725,7 @@ void GPU::createFramebuffer      (uint32_t width,uint32_t height){
  */
 void GPU::deleteFramebuffer      (){
   /// \todo tato funkce by měla dealokovat framebuffer.
-    delete currFrameBuffer;
+    defaultFrameBuffer = FrameBuffer();
 }
 
 /**
@@ -540,30 +736,50 @@ void GPU::deleteFramebuffer      (){
  */
 void     GPU::resizeFramebuffer(uint32_t width,uint32_t height){
   /// \todo Tato funkce by měla změnit velikost framebuffer.
-    currFrameBuffer->color_buffer->resize(size_t((uint64_t)width * (uint64_t)height * 4));
-    currFrameBuffer->depth_buffer->resize(size_t((uint64_t)width * (uint64_t)height));
     currFrameBuffer->width = width;
     currFrameBuffer->height = height;
+    currFrameBuffer->set_up_blocks();
+    for (ColorBuffer& color : currFrameBuffer->colors) color.buffer.resize(currFrameBuffer->stored_samples() * color.bytes());
+    currFrameBuffer->depth_buffer.resize(currFrameBuffer->stored_samples() * currFrameBuffer->depth_bytes());
 }
 
 /**
  * @brief This function returns pointer to color buffer.
+ * Pixels are stored in format of the buffer (4 bytes RGBA for RGBA8), row by row.
+ * MORTON_BLOCKS buffer is converted to linear copy and multisampled buffer is resolved
+ * (samples averaged) to a copy, the pointer is then to that copy.
+ *
+ * @param attachment color attachment of framebuffer object (framebuffer has only 0)
  *
- * @return pointer to color buffer
+ * @return pointer to color buffer (nullptr if there is no such attachment)
  */
-uint8_t* GPU::getFramebufferColor  (){
+uint8_t* GPU::getFramebufferColor  (uint32_t attachment){
   /// \todo Tato funkce by měla vrátit ukazatel na začátek barevného bufferu.<br>
-    return currFrameBuffer->color_buffer->data();
+    FrameBuffer* fb = currFrameBuffer;
+    if (attachment >= fb->colors.size()) return nullptr;
+    fb->resolve();
+    return fb->linear_color(attachment);
 }
 
 /**
  * @brief This function returns pointer to depth buffer.
+ * D16, D24, MORTON_BLOCKS and multisampled buffers are converted to linear float copy (NDC z), so the pointer is to that copy.
+ * Multisampled buffer gives depth of sample 0.
  *
  * @return pointer to dept buffer.
  */
 float* GPU::getFramebufferDepth    (){
   /// \todo tato funkce by mla vrátit ukazatel na začátek hloubkového bufferu.<br>
-    return currFrameBuffer->depth_buffer->data();
+    FrameBuffer* fb = currFrameBuffer;
+    fb->resolve();
+    if (fb->depth_format == DepthFormat::D32F && fb->layout == FramebufferLayout::LINEAR && fb->samples == 1) return (float*)fb->depth_buffer.data();
+
+    fb->depth_readback.resize((size_t)fb->width * fb->height);
+    float* dst = fb->depth_readback.data();
+    for (uint32_t y = 0; y < fb->height; y++)
+        for (uint32_t x = 0; x < fb->width; x++)
+            *dst++ = fb->read_depth(fb->pixel_index(x, y) * fb->samples);
+    return fb->depth_readback.data();
 }
 
 /**
@@ -573,7 +789,6 @@ float* GPU::getFramebufferDepth    (){
  */
 uint32_t GPU::getFramebufferWidth (){
   /// \todo Tato funkce by měla vrátit šířku framebufferu.
-    if (currFrameBuffer == nullptr) return 0;
     return currFrameBuffer->width;
 }
 
@@ -584,10 +799,184 @@ uint32_t GPU::getFramebufferWidth (){
  */
 uint32_t GPU::getFramebufferHeight(){
   /// \todo Tato funkce by měla vrátit výšku framebufferu.
-    if (currFrameBuffer == nullptr) return 0;
     return currFrameBuffer->height;
 }
 
+/**
+ * @brief This function selects memory layout of color and depth buffer, content is kept.
+ * getFramebufferColor/getFramebufferDepth always return linear buffers.
+ *
+ * @param layout LINEAR (default) or MORTON_BLOCKS
+ */
+void GPU::setFramebufferLayout   (FramebufferLayout layout){
+    currFrameBuffer->set_layout(layout);
+}
+
+/**
+ * @brief This function selects number of samples per pixel of color and depth buffer (multisampling).
+ * Fragment shader runs once per pixel, coverage and depth test are done per sample and color buffer
+ * is resolved when it's read back. Buffers are reset to the last clear values.
+ *
+ * @param samples 1 (default), 4 or 8 (other counts are rounded up)
+ */
+void GPU::setFramebufferSamples  (uint32_t samples){
+    FrameBuffer* fb = currFrameBuffer;
+    samples = samples > 4 ? 8 : samples > 1 ? 4 : 1;
+    if (fb->samples == samples) return;
+    fb->samples = samples;
+    for (ColorBuffer& color : fb->colors) color.buffer.resize(fb->stored_samples() * color.bytes());
+    fb->depth_buffer.resize(fb->stored_samples() * fb->depth_bytes());
+    fb->set_up_blocks();
+}
+
+/**
+ * @brief This function creates framebuffer object with several color attachments.
+ *
+ * @param width width of framebuffer object
+ * @param height height of framebuffer object
+ * @param nofColors number of color attachments (up to maxDrawBuffers, 0 for depth only)
+ * @param colors format of each color attachment
+ * @param depth format of depth buffer
+ *
+ * @return framebuffer object id
+ */
+FramebufferID GPU::createFramebufferObject(uint32_t width,uint32_t height,uint32_t nofColors,ColorFormat const* colors,DepthFormat depth){
+    FramebufferID id = framebuffers.create();
+    framebuffers.find(id)->set_up(width, height, depth, std::min(nofColors, maxDrawBuffers), colors);
+    return id;
+}
+
+/**
+ * @brief This function deletes framebuffer object, framebuffer is bound instead if it was bound.
+ *
+ * @param fbo framebuffer object id
+ */
+void GPU::deleteFramebufferObject(FramebufferID fbo){
+    FrameBuffer* frame = framebuffers.find(fbo);
+    if (frame != nullptr) {
+        if (currFrameBuffer == frame) currFrameBuffer = &defaultFrameBuffer;
+        framebuffers.erase(fbo);
+    }
+}
+
+/**
+ * @brief This function binds framebuffer object, draws, clears and framebuffer functions then use it.
+ *
+ * @param fbo framebuffer object id
+ */
+void GPU::bindFramebuffer        (FramebufferID fbo){
+    FrameBuffer* frame = framebuffers.find(fbo);
+    if (frame != nullptr) {
+        currFrameBuffer = frame;
+    }
+}
+
+/**
+ * @brief This function unbinds framebuffer object, framebuffer is used again.
+ */
+void GPU::unbindFramebuffer      (){
+    currFrameBuffer = &defaultFrameBuffer;
+}
+
+/**
+ * @brief This function tests if framebuffer object exists.
+ *
+ * @param fbo framebuffer object id
+ *
+ * @return true if framebuffer object exists
+ */
+bool GPU::isFramebuffer          (FramebufferID fbo){
+    return framebuffers.find(fbo) != nullptr;
+}
+
+/**
+ * @brief This function sets number of buffers of swap chain (framebuffer and images waiting for readers).
+ * Waits until all presented frames are released.
+ *
+ * @param nofBuffers number of buffers including framebuffer, at least 2 (default 2)
+ */
+void GPU::setSwapChainLength     (uint32_t nofBuffers){
+    std::unique_lock<std::mutex> lock(swapChainMutex);
+    swapChainReleased.wait(lock, [this] {
+        for (SwapImage const& image : swapImages) if (image.held) return false;
+        return true;
+    });
+    swapImages.assign(std::max(nofBuffers, 2u) - 1, SwapImage());
+}
+
+/**
+ * @brief This function presents framebuffer, its content goes to swap chain image and rendering continues
+ * to another buffer (with undefined content, clear it). Waits when all images are still held by readers.
+ *
+ * @return handle of presented frame for getPresentedColor and releasePresented
+ */
+PresentID GPU::present           (){
+    defaultFrameBuffer.resolve();
+
+    std::unique_lock<std::mutex> lock(swapChainMutex);
+    SwapImage* image = nullptr;
+    swapChainReleased.wait(lock, [this, &image] {
+        for (SwapImage& candidate : swapImages) {
+            if (!candidate.held) {
+                image = &candidate;
+                return true;
+            }
+        }
+        return false;
+    });
+    std::swap(image->frame, defaultFrameBuffer);
+    image->id = nextPresentID++;
+    image->held = true;
+    PresentID id = image->id;
+    lock.unlock();
+
+    //image got to the back for the first time or framebuffer was recreated since it was used
+    if (!defaultFrameBuffer.same_shape(image->frame)) defaultFrameBuffer.set_up_like(image->frame);
+    return id;
+}
+
+/* @brief Function finds image with presented frame, caller holds swapChainMutex.
+ */
+GPU::SwapImage* GPU::findPresented(PresentID frame) {
+    for (SwapImage& image : swapImages) {
+        if (image.held && image.id == frame) return &image;
+    }
+    return nullptr;
+}
+
+/**
+ * @brief This function returns color buffer of presented frame (linear, in format of the buffer).
+ * Can be called from any thread, data stay valid until the frame is released.
+ *
+ * @param frame handle returned by present
+ * @param attachment color attachment
+ *
+ * @return pointer to color buffer (nullptr if frame is not held or has no such attachment)
+ */
+uint8_t const* GPU::getPresentedColor(PresentID frame,uint32_t attachment){
+    SwapImage* image;
+    {
+        std::lock_guard<std::mutex> lock(swapChainMutex);
+        image = findPresented(frame);
+    }
+    //held image is touched only by its reader
+    if (image == nullptr || attachment >= image->frame.colors.size()) return nullptr;
+    return image->frame.linear_color(attachment);
+}
+
+/**
+ * @brief This function gives presented frame back to swap chain. Can be called from any thread.
+ *
+ * @param frame handle returned by present
+ */
+void GPU::releasePresented       (PresentID frame){
+    std::lock_guard<std::mutex> lock(swapChainMutex);
+    SwapImage* image = findPresented(frame);
+    if (image == nullptr) return;
+    image->held = false;
+    swapChainReleased.notify_all();
+}
+
 /// @}
 
 /** \addtogroup draw_tasks 05. Implementace vykreslovacích funkcí
@@ -595,6 +984,121 @@ uint32_t GPU::getFramebufferHeight(){
  * @{
  */
 
+/* @brief Function assembles triangles of one chunk from shaded vertices,
+   clips them and transforms them to screen space (with triangle setup).
+   Extra triangles made by clipping go to clippedTriangles[chunk].
+ */
+void GPU::processTriangles(uint32_t chunk) {
+    uint32_t begin = chunk * triangleChunk;
+    uint32_t end = std::min(begin + triangleChunk, (uint32_t)triangles.size());
+    std::vector<Triangle>& clipped = clippedTriangles[chunk];
+    clipped.clear();
+    DrawStats stats;
+    uint32_t piece = findPiece(&DrawPiece::triangle, begin);
+
+    for (uint32_t i = begin; i < end; i++) {
+        while (piece + 1 < drawPieces.size() && i >= drawPieces[piece + 1].triangle) piece++;
+        DrawPiece const& p = drawPieces[piece];
+        DrawRange const& range = drawRanges[p.range];
+        uint32_t per_instance = range.nof_vertices / 3;
+        uint32_t local = i - p.triangle;
+        uint32_t const* refs = &vertexRefs[range.refs + (local % per_instance) * 3];
+        uint32_t base = p.slot + (local / per_instance) * range.nof_shaded;
+
+        Triangle* t = &triangles[i];
+        t->valid = true;
+        t->point[0] = outVertices[base + refs[0]];
+        t->point[1] = outVertices[base + refs[1]];
+        t->point[2] = outVertices[base + refs[2]];
+
+        //triangle.gl_position.w -> clip space
+        uint32_t first = (uint32_t)clipped.size();
+        clipTriangle(t, clipped);
+        t->clip_first = first;
+        t->clip_count = (uint32_t)clipped.size() - first;
+
+        if (t->valid) projectTriangle(t, stats);
+        else stats.culled_view++;
+        for (uint32_t k = first; k < first + t->clip_count; k++) projectTriangle(&clipped[k], stats);
+    }
+
+    std::lock_guard<std::mutex> lock(drawStatsMutex);
+    drawStats.add(stats);
+}
+
+/* @brief Function transforms clipped triangle to screen space, culls it and sets it up for rasterization.
+ */
+void GPU::projectTriangle(Triangle* t, DrawStats& stats) {
+    uint32_t width = currFrameBuffer->width;
+    uint32_t height = currFrameBuffer->height;
+
+    //reshaping to normalized
+    for (int p = 0; p < 3; p++) {
+        t->point[p].gl_Position.x /= t->point[p].gl_Position.w;
+        t->point[p].gl_Position.y /= t->point[p].gl_Position.w;
+        t->point[p].gl_Position.z /= t->point[p].gl_Position.w;
+    }
+
+    //resizing to screen size
+    for (int p = 0; p < 3; p++) {
+        t->point[p].gl_Position.x = (t->point[p].gl_Position.x + 1.f) / 2.f * width;
+        t->point[p].gl_Position.y = (t->point[p].gl_Position.y + 1.f) / 2.f * height;
+    }
+
+    if (cullTriangle(t, stats)) {
+        t->valid = false;
+        return;
+    }
+    setUpTriangle(t);
+}
+
+/* @brief Cull stage, runs on screen space triangle before setup.
+   Culls zero area triangles, triangles facing away (by cullFace / frontFace)
+   and triangles whose bounding box contains no pixel center.
+   @return true if triangle should be dropped
+ */
+bool GPU::cullTriangle(Triangle* t, DrawStats& stats) {
+    glm::vec4* a = &(t->point[0].gl_Position);
+    glm::vec4* b = &(t->point[1].gl_Position);
+    glm::vec4* c = &(t->point[2].gl_Position);
+
+    //twice the signed area, positive for counter-clockwise (y goes up)
+    float area = (b->x - a->x) * (c->y - a->y) - (c->x - a->x) * (b->y - a->y);
+    if (area == 0.f) {
+        stats.culled_zero_area++;
+        return true;
+    }
+
+    if (cullFace != CullFace::NONE) {
+        bool front = (area > 0) == (frontFace == FrontFace::CCW);
+        if (cullFace == CullFace::FRONT_AND_BACK || (front && cullFace == CullFace::FRONT) || (!front && cullFace == CullFace::BACK)) {
+            stats.culled_face++;
+            return true;
+        }
+    }
+
+    if (smallPrimitiveCulling) {
+        //no sample position k + 0.5 + offset inside bounding box (in x or in y) for any sample of pixel
+        float minX = std::min(std::min(a->x, b->x), c->x);
+        float maxX = std::max(std::max(a->x, b->x), c->x);
+        float minY = std::min(std::min(a->y, b->y), c->y);
+        float maxY = std::max(std::max(a->y, b->y), c->y);
+        uint32_t samples = currFrameBuffer->samples;
+        SampleOffset const* pattern = samplePattern(samples);
+        bool hit = false;
+        for (uint32_t s = 0; s < samples && !hit; s++) {
+            float x = 0.5f + pattern[s].x;
+            float y = 0.5f + pattern[s].y;
+            hit = std::ceil(minX - x) <= std::floor(maxX - x) && std::ceil(minY - y) <= std::floor(maxY - y);
+        }
+        if (!hit) {
+            stats.culled_small++;
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * @brief This functino clears framebuffer.
  *
@@ -610,366 +1114,678 @@ void            GPU::clear                 (float r,float g,float b,float a){
   /// Hloubkový buffer nastaví na takovou hodnotu, která umožní rasterizaci trojúhelníka, který leží v rámci pohledového tělesa.<br>
   /// Hloubka by měla být tedy větší než maximální hloubka v NDC (normalized device coordinates).<br>
     //TODO co s cisly mezi (0,1)??
-    
-    uint8_t* color = getFramebufferColor();
-    float* depth = getFramebufferDepth();
 
-    uint64_t max = (uint64_t) getFramebufferHeight() * (uint64_t) getFramebufferWidth();
+    //clear color is packed once to pixel of the format, fill then only copies it
+    for (ColorBuffer& color : currFrameBuffer->colors) color.write(color.clear_color, 0, glm::vec4(r, g, b, a));
+    currFrameBuffer->clear_depth = 2.f;
+    currFrameBuffer->reset_hiz(currFrameBuffer->clear_depth);
 
-    for (int i = 0; i < max; i++) {
-        depth[i] = 2;
+    if (lazyClear) {
+        //tiles get the clear value when they are first drawn to or read back
+        std::fill(currFrameBuffer->tile_pending.begin(), currFrameBuffer->tile_pending.end(), (uint8_t)1);
+        return;
     }
+    std::fill(currFrameBuffer->tile_pending.begin(), currFrameBuffer->tile_pending.end(), (uint8_t)0);
+    currFrameBuffer->fill(0, 0, currFrameBuffer->width, currFrameBuffer->height, true);
+}
 
-    uint8_t red, green, blue, alpha;
-    if (r <= 0) red = 0;
-    else if (r >= 1) red = 255;
-    else red = r * 255;
-
-    if (g <= 0) green = 0;
-    else if (g >= 1) green = 255;
-    else green = g * 255;
+/**
+ * @brief This function enables lazy clear.
+ * clear() then only remembers clear values, tile gets them when it's first drawn to or read back.
+ *
+ * @param enabled true to clear lazily
+ */
+void            GPU::setLazyClear          (bool      enabled){
+    lazyClear = enabled;
+}
 
-    if (b <= 0) blue = 0;
-    else if (b >= 1) blue = 255;
-    else blue = b * 255;
+/* @brief Index reader specialized for one IndexType.
+ */
+template<typename T>
+static uint32_t readIndex(uint8_t const* indices, uint32_t vertex_num) {
+    T index;
+    memcpy(&index, indices + (uint64_t)vertex_num * sizeof(T), sizeof(T));
+    return index;
+}
 
-    if (a <= 0) alpha = 0;
-    else if (a >= 1) alpha = 255;
-    else alpha = a * 255;
+/* @brief Attribute reader specialized for one AttributeType.
+ */
+template<typename T>
+static void readAttribute(Attribute& attribute, uint8_t const* data) {
+    //buffer data may be unaligned, components are copied to floats first, the rest of attribute keeps its default
+    uint32_t const components = sizeof(T) / sizeof(float);
+    float value[components];
+    memcpy(value, data, sizeof(T));
+    for (uint32_t c = 0; c < components; c++) attribute.v4[c] = value[c];
+}
 
-    max *= 4; //max pro color buffer
-    int order = 0;
+/* @brief Function resolves currVertexPuller for the draw into raw pointers and readers,
+   so fetching a vertex does no buffer lookups (and no allocations).
+ */
+void GPU::compileVertexPuller() {
+    CompiledPuller* cp = &compiledPuller;
+    cp->indices = nullptr;
+    cp->read_index = nullptr;
+    if (currVertexPuller->indexing) {
+        Buffer* indices = buffers.find(currVertexPuller->index_buffer);
+        if (indices != nullptr && indices->usable()) cp->indices = indices->bytes();
+        if (currVertexPuller->index_type == IndexType::UINT8) cp->read_index = readIndex<uint8_t>;
+        else if (currVertexPuller->index_type == IndexType::UINT16) cp->read_index = readIndex<uint16_t>;
+        else cp->read_index = readIndex<uint32_t>;
+    }
 
-    for (int i = 0; i < max; i++) {
-        if (order == 0) {
-            color[i] = red;
-            order++;
-        }
-        else if (order == 1) {
-            color[i] = green;
-            order++;
-        }
-        else if (order == 2) {
-            color[i] = blue;
-            order++;
-        }
-        else {
-            color[i] = alpha;
-            order = 0;
-        }
+    cp->nof_heads = 0;
+    for (uint32_t i = 0; i < maxAttributes; i++) {
+        Head* head = &currVertexPuller->heads[i];
+        if (!head->enabled || head->type == AttributeType::EMPTY) continue;
+        Buffer* data = buffers.find(head->buffer);
+        if (data == nullptr || !data->usable()) continue;
+
+        CompiledHead* ch = &cp->heads[cp->nof_heads++];
+        ch->data = data->bytes() + head->offset;
+        ch->stride = head->stride;
+        ch->attribute = i;
+        ch->components = (uint32_t)head->type;
+        ch->divisor = head->divisor;
+        if (head->type == AttributeType::FLOAT) ch->read = readAttribute<float>;
+        else if (head->type == AttributeType::VEC2) ch->read = readAttribute<glm::vec2>;
+        else if (head->type == AttributeType::VEC3) ch->read = readAttribute<glm::vec3>;
+        else ch->read = readAttribute<glm::vec4>;
     }
 }
 
+/* @brief Function reads one index from index buffer of compiled vertex puller.
+   @param vertex_num position in index buffer
+   @return gl_VertexID stored there
+ */
+uint32_t GPU::fetchIndex(uint32_t vertex_num) {
+    if (compiledPuller.indices == nullptr) return 0;
+    return compiledPuller.read_index(compiledPuller.indices, vertex_num);
+}
+
 /* @brief Function extracts and returns one InVertex from currVertexPuller settings.
    @param timesCalled used as index in index mode, as id in non-index
    @return Extracted InVertex.
  */
 InVertex GPU::fetchInVertex(uint32_t vertex_num) {
+    VertexKey key = { vertex_num, 0, 0 };
+    if (currVertexPuller->indexing) key.id = fetchIndex(vertex_num);
+    return fetchVertex(key);
+}
+
+/* @brief Function reads attributes of vertex from enabled heads.
+   Heads with divisor read element base_instance + instance / divisor instead of gl_VertexID.
+   @param key gl_VertexID and instance of the vertex
+   @return Extracted InVertex.
+ */
+InVertex GPU::fetchVertex(VertexKey const& key) {
     InVertex iv;
-    if (currVertexPuller->indexing) {
-        //indexing
-        void* data = calloc(1, sizeof(uint32_t));
-        if (currVertexPuller->index_type == IndexType::UINT8) {
-            getBufferData(currVertexPuller->index_buffer, vertex_num * sizeof(uint8_t), sizeof(uint8_t), data);
-            iv.gl_VertexID = *(uint8_t*)data;
-        }
-        else if (currVertexPuller->index_type == IndexType::UINT16) {
-            getBufferData(currVertexPuller->index_buffer, vertex_num * sizeof(uint16_t), sizeof(uint16_t), data);
-            iv.gl_VertexID = *(uint16_t*)data;
-        }
-        else {
-            //indextype::UINT32
-            getBufferData(currVertexPuller->index_buffer, vertex_num * sizeof(uint32_t), sizeof(uint32_t), data);
-            iv.gl_VertexID = *(uint32_t*)data;
-        }
+    iv.gl_VertexID = key.id;
+
+    for (uint32_t i = 0; i < compiledPuller.nof_heads; i++) {
+        CompiledHead* head = &compiledPuller.heads[i];
+        uint32_t element = head->divisor ? key.base_instance + key.instance / head->divisor : key.id;
+        head->read(iv.attributes[head->attribute], head->data + head->stride * element);
     }
-    else {
-        //not indexing
-        iv.gl_VertexID = vertex_num;
+
+    return iv;
+}
+
+/* @brief Function reads given vertices into batch (structure of arrays).
+   Unused lanes repeat the last vertex, so batch shader can always process whole batch.
+   Only components read by enabled heads are written, rest of batch keeps what caller set it to.
+ */
+void GPU::fetchVertexBatch(InVertexBatch& batch, VertexKey const* keys, uint32_t count) {
+    batch.count = count;
+    for (uint32_t l = 0; l < vertexBatchSize; l++) {
+        batch.gl_VertexID[l] = keys[std::min(l, count - 1)].id;
+        batch.gl_InstanceID[l] = keys[std::min(l, count - 1)].instance;
     }
 
-    for (int i = 0; i < maxAttributes; i++) {
-        Head* head = &currVertexPuller->heads[i];
+    for (uint32_t i = 0; i < compiledPuller.nof_heads; i++) {
+        CompiledHead* head = &compiledPuller.heads[i];
+        float (*dst)[vertexBatchSize] = batch.attributes[head->attribute];
+        for (uint32_t l = 0; l < vertexBatchSize; l++) {
+            Attribute attribute;
+            VertexKey const& key = keys[std::min(l, count - 1)];
+            uint32_t element = head->divisor ? key.base_instance + key.instance / head->divisor : key.id;
+            head->read(attribute, head->data + head->stride * element);
+            for (uint32_t c = 0; c < head->components; c++) dst[c][l] = attribute.v4[c];
+        }
+    }
+}
 
-        if (head->enabled) {
-            
-            //if (!isBuffer(head->buffer)) continue;
+/* @brief Function returns index of last DrawPiece whose member (slot or triangle) is not above value.
+ */
+uint32_t GPU::findPiece(uint32_t DrawPiece::* member, uint32_t value) {
+    auto it = std::upper_bound(drawPieces.begin(), drawPieces.end(), value,
+        [member](uint32_t v, DrawPiece const& piece) { return v < piece.*member; });
+    return (uint32_t)(it - drawPieces.begin()) - 1;
+}
 
-            void* data = calloc(1, sizeof(glm::vec4));
-            uint32_t offset = head->offset + head->stride * iv.gl_VertexID;
+/* @brief Function returns vertex shaded in slot of outVertices.
+   @param piece index of DrawPiece with the slot, moved forward when slot is past it (slots are visited in order)
+ */
+GPU::VertexKey GPU::slotVertex(uint32_t slot, uint32_t& piece) {
+    while (piece + 1 < drawPieces.size() && slot >= drawPieces[piece + 1].slot) piece++;
+    DrawPiece const& p = drawPieces[piece];
+    DrawRange const& range = drawRanges[p.range];
+    uint32_t local = slot - p.slot;
+    VertexKey key;
+    key.id = shadedIDs[range.shaded + local % range.nof_shaded];
+    key.instance = p.first_instance + local / range.nof_shaded;
+    key.base_instance = range.base_instance;
+    return key;
+}
 
-            if (head->type == AttributeType::FLOAT) {
-                getBufferData(head->buffer, offset, sizeof(float), data);
-                iv.attributes[i].v1 = *(float*)data;
-                //printf("%f\n", iv.attributes[i].v1);
-            }
-            else if (head->type == AttributeType::VEC2) {
-                getBufferData(head->buffer, offset, sizeof(glm::vec2), data);
-                iv.attributes[i].v2 = *(glm::vec2*) data;
-                //printf("%f\n", *(float*)data);
-                //printf("X: %f\nY: %f\n\n", iv.attributes[i].v2.x, iv.attributes[i].v2.y);
-            }
-            else if (head->type == AttributeType::VEC3) {
-                getBufferData(head->buffer, offset, sizeof(glm::vec3), data);
-                iv.attributes[i].v3 = *(glm::vec3*)data;
-                //printf("X: %f\nY: %f\nZ: %f\n\n", iv.attributes[i].v3.x, iv.attributes[i].v3.y, iv.attributes[i].v3.z);
-            }
-            else if (head->type == AttributeType::VEC4) {
-                getBufferData(head->buffer, offset, sizeof(glm::vec4), data);
-                iv.attributes[i].v4 = *(glm::vec4*)data;
+/* @brief Function runs vertex shader for slots begin .. end - 1 of outVertices.
+   Batched shader of the program is used when there is one, scalar one otherwise.
+ */
+void GPU::shadeVertices(uint32_t begin, uint32_t end) {
+    uint32_t piece = findPiece(&DrawPiece::slot, begin);
+    if (currProgram->batch_vertex_shader == nullptr) {
+        for (uint32_t i = begin; i < end; i++) {
+            InVertex inv = fetchVertex(slotVertex(i, piece));
+            currProgram->vertex_shader(outVertices[i], inv, currProgram->uniforms);
+        }
+        return;
+    }
+
+    //zeroed as default constructed attributes of InVertex are, lanes of disabled heads and
+    //components the heads don't read keep it, as do outputs batch shader doesn't write
+    InVertexBatch in = {};
+    OutVertexBatch out = {};
+    VertexKey keys[vertexBatchSize];
+    for (uint32_t i = begin; i < end; i += vertexBatchSize) {
+        uint32_t count = std::min(vertexBatchSize, end - i);
+        for (uint32_t l = 0; l < count; l++) keys[l] = slotVertex(i + l, piece);
+        fetchVertexBatch(in, keys, count);
+        currProgram->batch_vertex_shader(out, in, currProgram->uniforms);
+
+        for (uint32_t l = 0; l < count; l++) {
+            OutVertex* ov = &outVertices[i + l];
+            ov->gl_Position = glm::vec4(out.gl_Position[0][l], out.gl_Position[1][l], out.gl_Position[2][l], out.gl_Position[3][l]);
+            for (uint32_t a = 0; a < maxAttributes; a++) {
+                uint32_t components = (uint32_t)currProgram->types[a];
+                for (uint32_t c = 0; c < components; c++) ov->attributes[a].v4[c] = out.attributes[a][c][l];
             }
-            //EMPTY type ommited
-            free(data);
         }
     }
-    
-    return iv;
 }
 
-void GPU::clipPlane(std::list<Triangle*>::iterator it) {
-    Triangle* t = (*it);
-    OutVertex* a = &(t->point[0]);
-    OutVertex* b = &(t->point[1]);
-    OutVertex* c = &(t->point[2]);
-
-    //near plane
-    bool a_out, b_out, c_out;
-    bool no_new = true;
-    if (-a->gl_Position.w <= a->gl_Position.x && -a->gl_Position.w <= a->gl_Position.y && -a->gl_Position.w <= a->gl_Position.z) a_out = false;
-    else a_out = true;
-    if (-b->gl_Position.w <= b->gl_Position.x && -b->gl_Position.w <= b->gl_Position.y && -b->gl_Position.w <= b->gl_Position.z) b_out = false;
-    else b_out = true;
-    if (-c->gl_Position.w <= c->gl_Position.x && -c->gl_Position.w <= c->gl_Position.y && -c->gl_Position.w <= c->gl_Position.z) c_out = false;
-    else c_out = true;
-
-    int out_cnt = a_out + b_out + c_out;
-    if (out_cnt > 2) {
-        //all out, whole triagle gets thrown out
-        t->valid = false;
-        return;
+/* @brief Function selects vertices of one draw command that need shading and adds them as new DrawRange.
+   shadedIDs holds gl_VertexID of every shaded vertex, vertexRefs tells which one belongs to each vertex of command.
+   With indexing, every index is shaded only once per instance (post-transform cache),
+   repeated indices reuse the already shaded OutVertex.
+ */
+void GPU::processVertices(DrawIndirectCommand const& command) {
+    DrawRange range;
+    range.refs = (uint32_t)vertexRefs.size();
+    range.nof_vertices = command.count;
+    range.shaded = (uint32_t)shadedIDs.size();
+    range.nof_instances = command.instance_count;
+    range.base_instance = command.base_instance;
+    vertexRefs.resize(range.refs + command.count);
+    uint32_t* refs = vertexRefs.data() + range.refs;
+
+    if (!currVertexPuller->indexing) {
+        for (uint32_t i = 0; i < command.count; i++) {
+            shadedIDs.push_back(command.first_index + i);
+            refs[i] = i;
+        }
     }
-    else if (out_cnt == 2) {
-        //two points out of clipping space
-        //TODO
+    else {
+        for (uint32_t i = 0; i < command.count; i++) {
+            uint32_t index = fetchIndex(command.first_index + i);
+            if (index >= cacheSlots.size()) cacheSlots.resize((size_t)index + 1, noSlot);
+            if (cacheSlots[index] == noSlot) {
+                cacheSlots[index] = (uint32_t)shadedIDs.size() - range.shaded;
+                shadedIDs.push_back(index + command.base_vertex);
+                drawStats.vertex_cache_misses++;
+            }
+            else drawStats.vertex_cache_hits++;
+            refs[i] = cacheSlots[index];
+        }
+        //only touched entries are reset, table is kept for next draw
+        for (uint32_t i = range.shaded; i < shadedIDs.size(); i++) cacheSlots[shadedIDs[i] - command.base_vertex] = noSlot;
     }
-    else if (out_cnt == 1) {
-        //one point out of clipping space
-        //TODO
+    range.nof_shaded = (uint32_t)shadedIDs.size() - range.shaded;
+    drawRanges.push_back(range);
+}
+
+/* @brief Signed distance of clip space point from one clipping plane, >= 0 is inside.
+   Planes: 0 near, 1 far, 2 - 5 left, right, bottom, top moved out to guard band.
+ */
+static float clipDistance(uint32_t plane, glm::vec4 const& p, float guard) {
+    switch (plane) {
+    case 0: return p.z + p.w;
+    case 1: return p.w - p.z;
+    case 2: return p.x + guard * p.w;
+    case 3: return guard * p.w - p.x;
+    case 4: return p.y + guard * p.w;
+    default: return guard * p.w - p.y;
     }
-    //if no point is out, nothing happens
+}
 
-    //far plane
-    if (no_new) {
-        //no clipping done so we can use original vertexes
-        if (a->gl_Position.w >= a->gl_Position.x && a->gl_Position.w >= a->gl_Position.y && a->gl_Position.w >= a->gl_Position.z) a_out = false;
-        else a_out = true;
-        if (b->gl_Position.w >= b->gl_Position.x && b->gl_Position.w >= b->gl_Position.y && b->gl_Position.w >= b->gl_Position.z) b_out = false;
-        else b_out = true;
-        if (c->gl_Position.w >= c->gl_Position.x && c->gl_Position.w >= c->gl_Position.y && c->gl_Position.w >= c->gl_Position.z) c_out = false;
-        else c_out = true;
+/* @brief Function returns bit mask of planes the point is outside of.
+ */
+static uint32_t clipOutCode(glm::vec4 const& p, float guard) {
+    uint32_t code = 0;
+    for (uint32_t plane = 0; plane < 6; plane++) {
+        if (clipDistance(plane, p, guard) < 0) code |= 1u << plane;
     }
-    else {
-        //TODO figure out bools differently
+    return code;
+}
+
+/* @brief Function linearly interpolates clip space vertex (position and used attributes).
+ */
+static void lerpVertex(OutVertex& out, OutVertex const& a, OutVertex const& b, float t, AttributeType const* types) {
+    out.gl_Position = a.gl_Position + (b.gl_Position - a.gl_Position) * t;
+    for (uint32_t i = 0; i < maxAttributes; i++) {
+        uint32_t components = (uint32_t)types[i];
+        for (uint32_t c = 0; c < components; c++) {
+            out.attributes[i].v4[c] = a.attributes[i].v4[c] + (b.attributes[i].v4[c] - a.attributes[i].v4[c]) * t;
+        }
     }
+}
+
+/* @brief Function clips triangle in homogeneous clip space.
+   Triangles fully outside one plane of view volume are rejected.
+   Near and far planes are clipped exactly. Left, right, bottom and top are only clipped when
+   the triangle leaves the guard band, inside it the rasterizer's bounding box clamp handles them.
+   Clipped polygon is split to fan, first triangle replaces t, others are appended to out.
+ */
+void GPU::clipTriangle(Triangle* t, std::vector<Triangle>& out) {
+    glm::vec4 const& a = t->point[0].gl_Position;
+    glm::vec4 const& b = t->point[1].gl_Position;
+    glm::vec4 const& c = t->point[2].gl_Position;
 
-    out_cnt = a_out + b_out + c_out;
-    if (out_cnt > 2) {
+    //all vertices outside the same plane of view volume
+    if (clipOutCode(a, 1.f) & clipOutCode(b, 1.f) & clipOutCode(c, 1.f)) {
         t->valid = false;
+        return;
     }
-    else if (out_cnt == 2) {
-        //two points out of clipping space
-        //TODO
-    }
-    else if (out_cnt == 1) {
-        //one point out of clipping space
-        //TODO
-    }
-    //if no point is out, nothing happens
-}
-
-void GPU::interpolate(InFragment* inF, Triangle* t) {
-    OutVertex a = t->point[0];
-    OutVertex b = t->point[1];
-    OutVertex c = t->point[2];
-
-    //algorithm copied from https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
-    //from answer by John Calsbeek, claiming it is transcribed from Christer Ericson's "Real-Time Collision Detection"
-    glm::vec4 v0 = b.gl_Position - a.gl_Position;
-    glm::vec4 v1 = c.gl_Position - a.gl_Position;
-    glm::vec4 v2 = inF->gl_FragCoord - a.gl_Position;
-    float d00 = glm::dot(v0, v0);
-    float d01 = glm::dot(v0, v1);
-    float d11 = glm::dot(v1, v1);
-    float d20 = glm::dot(v2, v0);
-    float d21 = glm::dot(v2, v1);
-    float denom = d00 * d11 - d01 * d01;
-    float l1 = (d11 * d20 - d01 * d21) / denom;
-    float l2 = (d00 * d21 - d01 * d20) / denom;
-    float l0 = 1.0f - l2 - l1;
-    //end of copied algorithm
-
-    float h0 = a.gl_Position.w;
-    float h1 = b.gl_Position.w;
-    float h2 = c.gl_Position.w;
-
-    float mul0 = l0 / h0;
-    float mul1 = l1 / h1;
-    float mul2 = l2 / h2;
-    float div = mul0 + mul1 + mul2;
-    
-    inF->gl_FragCoord.z = (a.gl_Position.z * mul0 + b.gl_Position.z * mul1 + c.gl_Position.z * mul2) / div;
 
-    for (int i = 0; i < maxAttributes; i++) {
-        AttributeType type = currProgram->types[i];
-        if (type == AttributeType::FLOAT) {
-            inF->attributes[i].v1 = (a.attributes[i].v1 * mul0 + b.attributes[i].v1 * mul1 + c.attributes[i].v1 * mul2) / div;
-        }
-        else if (type == AttributeType::VEC2) {
-            inF->attributes[i].v2 = (a.attributes[i].v2 * mul0 + b.attributes[i].v2 * mul1 + c.attributes[i].v2 * mul2) / div;
+    uint32_t planes = clipOutCode(a, guardBand) | clipOutCode(b, guardBand) | clipOutCode(c, guardBand);
+    if (!planes) return; //common case, nothing to clip
+
+    //Sutherland-Hodgman, every plane adds at most one vertex
+    OutVertex poly[2][3 + 6];
+    uint32_t n = 3;
+    for (int i = 0; i < 3; i++) poly[0][i] = t->point[i];
+    OutVertex* src = poly[0];
+    OutVertex* dst = poly[1];
+
+    for (uint32_t plane = 0; plane < 6; plane++) {
+        if (!(planes & (1u << plane))) continue;
+        uint32_t m = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            OutVertex const& p = src[i];
+            OutVertex const& q = src[(i + 1) % n];
+            float dp = clipDistance(plane, p.gl_Position, guardBand);
+            float dq = clipDistance(plane, q.gl_Position, guardBand);
+            if (dp >= 0) dst[m++] = p;
+            if ((dp >= 0) != (dq >= 0)) lerpVertex(dst[m++], p, q, dp / (dp - dq), currProgram->types);
         }
-        else if (type == AttributeType::VEC3) {
-            inF->attributes[i].v3 = (a.attributes[i].v3 * mul0 + b.attributes[i].v3 * mul1 + c.attributes[i].v3 * mul2) / div;
-        }
-        else if (type == AttributeType::VEC4) {
-            inF->attributes[i].v4 = (a.attributes[i].v4 * mul0 + b.attributes[i].v4 * mul1 + c.attributes[i].v4 * mul2) / div;
+        std::swap(src, dst);
+        n = m;
+        if (n < 3) {
+            t->valid = false;
+            return;
         }
     }
+
+    t->point[0] = src[0];
+    t->point[1] = src[1];
+    t->point[2] = src[2];
+    for (uint32_t i = 3; i < n; i++) {
+        out.emplace_back();
+        Triangle* extra = &out.back();
+        extra->point[0] = src[0];
+        extra->point[1] = src[i - 1];
+        extra->point[2] = src[i];
+    }
 }
 
-void GPU::createFragment(Triangle* t, float x, float y) {
-    InFragment inF;
-    inF.gl_FragCoord.x = x;
-    inF.gl_FragCoord.y = y;
-    interpolate(&inF, t);
+/* @brief Function computes edge functions and plane equations of depth and attributes.
+   Called once per triangle in screen space, so fragments only evaluate planes.
+   Perspective correction: attribute/w and 1/w are linear in screen space.
+ */
+void GPU::setUpTriangle(Triangle* t) {
+    glm::vec4* a = &(t->point[0].gl_Position);
+    glm::vec4* b = &(t->point[1].gl_Position);
+    glm::vec4* c = &(t->point[2].gl_Position);
 
-    OutFragment outF;
-    currProgram->fragment_shader(outF, inF, currProgram->uniforms);
-    
-    // test drawing? TODO decide
-    uint8_t* colorBuffer = getFramebufferColor();
-    float* depthBuffer = getFramebufferDepth();
+    Edges* e = &t->edges;
+    e->ax = a->x; e->ay = a->y;
+    e->bx = b->x; e->by = b->y;
+    e->cx = c->x; e->cy = c->y;
+    e->abdely = b->y - a->y;
+    e->abdelx = b->x - a->x;
+    e->bcdely = c->y - b->y;
+    e->bcdelx = c->x - b->x;
+    e->cadely = a->y - c->y;
+    e->cadelx = a->x - c->x;
+
+    //zero area triangle has no barycentrics
+    float denom = e->abdelx * (c->y - a->y) - (c->x - a->x) * e->abdely;
+    if (denom == 0.f) {
+        t->valid = false;
+        return;
+    }
+
+    //barycentric coordinates of b and c as planes
+    float l1x = (c->y - a->y) / denom;
+    float l1y = -(c->x - a->x) / denom;
+    float l2x = -e->abdely / denom;
+    float l2y = e->abdelx / denom;
+    auto plane = [&](float f0, float f1, float f2) {
+        Plane p;
+        p.c = f0;
+        p.dx = (f1 - f0) * l1x + (f2 - f0) * l2x;
+        p.dy = (f1 - f0) * l1y + (f2 - f0) * l2y;
+        return p;
+    };
+
+    t->z_min = std::min(std::min(a->z, b->z), c->z);
+    t->z_max = std::max(std::max(a->z, b->z), c->z);
+
+    float w0 = 1.f / a->w;
+    float w1 = 1.f / b->w;
+    float w2 = 1.f / c->w;
+    t->inv_w = plane(w0, w1, w2);
+    t->z_w = plane(a->z * w0, b->z * w1, c->z * w2);
+
+    for (uint32_t i = 0; i < maxAttributes; i++) {
+        uint32_t components = (uint32_t)currProgram->types[i];
+        for (uint32_t j = 0; j < components; j++) {
+            t->attributes[i][j] = plane(t->point[0].attributes[i].v4[j] * w0,
+                                        t->point[1].attributes[i].v4[j] * w1,
+                                        t->point[2].attributes[i].v4[j] * w2);
+        }
+    }
+
+    //edges are oriented so inside is where all edge functions are >= 0 (exact negation), otherwise
+    //sample lying exactly on edge shared by two triangles of the other winding was left to neither of them,
+    //coverage tests then check only this sign
+    if (denom > 0.f) {
+        e->abdely = -e->abdely;
+        e->abdelx = -e->abdelx;
+        e->bcdely = -e->bcdely;
+        e->bcdelx = -e->bcdelx;
+        e->cadely = -e->cadely;
+        e->cadelx = -e->cadelx;
+    }
+}
 
+/* @brief Function interpolates fragment attributes.
+   @param w interpolated clip space w of the fragment (1 / interpolated 1/w)
+ */
+void GPU::interpolate(InFragment* inF, Triangle* t, float w) {
+    float x = inF->gl_FragCoord.x - t->edges.ax;
+    float y = inF->gl_FragCoord.y - t->edges.ay;
+
+    for (uint32_t i = 0; i < maxAttributes; i++) {
+        uint32_t components = (uint32_t)currProgram->types[i];
+        for (uint32_t j = 0; j < components; j++) {
+            inF->attributes[i].v4[j] = t->attributes[i][j].at(x, y) * w;
+        }
+    }
+}
+
+/* @brief Function creates one fragment, shades it and writes it to framebuffer.
+   Depth is tested before shading (early z), fragment shader can't change depth.
+   @param depth_test false when hierarchical z already knows the fragment passes
+   @param written_min lowered to the lowest depth written (for hierarchical z)
+   @return true if fragment was written
+ */
+bool GPU::createFragment(Triangle* t, float x, float y, bool depth_test, uint32_t coverage, float& written_min) {
+    FrameBuffer* fb = currFrameBuffer;
     uint32_t ix = (uint32_t)std::floor(x);
     uint32_t iy = (uint32_t)std::floor(y);
+    uint32_t samples = fb->samples;
+    size_t first = fb->pixel_index(ix, iy) * samples;
+
+    float rx = x - t->edges.ax;
+    float ry = y - t->edges.ay;
+    float w = 1.f / t->inv_w.at(rx, ry);
+    float z = t->z_w.at(rx, ry) * w;
+
+    //depth is tested per covered sample, fragment is shaded once if any of them passes
+    SampleOffset const* pattern = samplePattern(samples);
+    float sample_z[maxSamples];
+    uint32_t passed = 0;
+    for (uint32_t s = 0; s < samples; s++) {
+        if (!(coverage & (1u << s))) continue;
+        float sx = rx + pattern[s].x;
+        float sy = ry + pattern[s].y;
+        sample_z[s] = t->z_w.at(sx, sy) * (1.f / t->inv_w.at(sx, sy));
+        if (!depth_test || fb->depth_passes(first + s, sample_z[s])) passed |= 1u << s;
+    }
+    if (!passed) return false;
 
-    uint8_t r, g, b, a;
-
-    if (outF.gl_FragColor.r > 1) r = 1;
-    else if (outF.gl_FragColor.r < 0) r = 0;
-    else r = (uint8_t)round(outF.gl_FragColor.r * 255);
+    InFragment inF;
+    inF.gl_FragCoord.x = x;
+    inF.gl_FragCoord.y = y;
+    inF.gl_FragCoord.z = z;
+    interpolate(&inF, t, w);
+
+    std::vector<ColorBuffer>& colors = fb->colors;
+    if (currProgram->fragment_data_shader) {
+        OutFragmentData outD;
+        currProgram->fragment_data_shader(outD, inF, currProgram->uniforms);
+        for (size_t i = 0; i < colors.size(); i++) colors[i].write_samples(first, passed, outD.gl_FragData[i]);
+    }
+    else {
+        OutFragment outF;
+        currProgram->fragment_shader(outF, inF, currProgram->uniforms);
+        if (!colors.empty()) colors[0].write_samples(first, passed, outF.gl_FragColor);
+    }
+    for (uint32_t s = 0; s < samples; s++) {
+        if (!(passed & (1u << s))) continue;
+        fb->write_depth(first + s, sample_z[s]);
+        written_min = std::min(written_min, sample_z[s]);
+    }
+    return true;
+}
 
-    if (outF.gl_FragColor.g > 1) g = 1;
-    else if (outF.gl_FragColor.g < 0) g = 0;
-    else g = (uint8_t)round(outF.gl_FragColor.g * 255);
+/* @brief Scalar coverage kernel, pixel is covered when all edge functions are >= 0 (edges are oriented in setUpTriangle).
+ */
+static uint32_t coverageScalar(GPU::Edges const& e, float x, float y, uint32_t count) {
+    float abrow = (y - e.ay) * e.abdelx;
+    float bcrow = (y - e.by) * e.bcdelx;
+    float carow = (y - e.cy) * e.cadelx;
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        float px = x + (float)i;
+        float abfunc = (px - e.ax) * e.abdely - abrow;
+        float bcfunc = (px - e.bx) * e.bcdely - bcrow;
+        float cafunc = (px - e.cx) * e.cadely - carow;
+        if (abfunc >= 0 && bcfunc >= 0 && cafunc >= 0) mask |= 1u << i;
+    }
+    return mask;
+}
 
-    if (outF.gl_FragColor.b > 1) b = 1;
-    else if (outF.gl_FragColor.b < 0) b = 0;
-    else b = (uint8_t)round(outF.gl_FragColor.b * 255);
+#ifdef GPU_X86
+/* @brief SSE coverage kernel, 4 pixels per step. Same arithmetic as scalar one, so results match exactly.
+ */
+GPU_TARGET_SSE static uint32_t coverageSSE(GPU::Edges const& e, float x, float y, uint32_t count) {
+    __m128 steps = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 ax = _mm_set1_ps(e.ax), bx = _mm_set1_ps(e.bx), cx = _mm_set1_ps(e.cx);
+    __m128 abdely = _mm_set1_ps(e.abdely), bcdely = _mm_set1_ps(e.bcdely), cadely = _mm_set1_ps(e.cadely);
+    __m128 abrow = _mm_set1_ps((y - e.ay) * e.abdelx);
+    __m128 bcrow = _mm_set1_ps((y - e.by) * e.bcdelx);
+    __m128 carow = _mm_set1_ps((y - e.cy) * e.cadelx);
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 px = _mm_add_ps(_mm_set1_ps(x + (float)i), steps);
+        __m128 ab = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(px, ax), abdely), abrow);
+        __m128 bc = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(px, bx), bcdely), bcrow);
+        __m128 ca = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(px, cx), cadely), carow);
+        __m128 pos = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(ab, zero), _mm_cmpge_ps(bc, zero)), _mm_cmpge_ps(ca, zero));
+        mask |= (uint32_t)_mm_movemask_ps(pos) << i;
+    }
+    if (count < 32) mask &= (1u << count) - 1;
+    return mask;
+}
 
-    if (outF.gl_FragColor.a > 1) a = 1;
-    else if (outF.gl_FragColor.a < 0) a = 0;
-    else a = (uint8_t)round(outF.gl_FragColor.a * 255);
-    
-    /*if (r != 255) {
-        printf("%f %f %f %f\n", outF.gl_FragColor.r, outF.gl_FragColor.g, outF.gl_FragColor.b, outF.gl_FragColor.a);
-        exit(0);
-    }*/
+/* @brief AVX coverage kernel, 8 pixels per step.
+ */
+GPU_TARGET_AVX static uint32_t coverageAVX(GPU::Edges const& e, float x, float y, uint32_t count) {
+    __m256 steps = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 ax = _mm256_set1_ps(e.ax), bx = _mm256_set1_ps(e.bx), cx = _mm256_set1_ps(e.cx);
+    __m256 abdely = _mm256_set1_ps(e.abdely), bcdely = _mm256_set1_ps(e.bcdely), cadely = _mm256_set1_ps(e.cadely);
+    __m256 abrow = _mm256_set1_ps((y - e.ay) * e.abdelx);
+    __m256 bcrow = _mm256_set1_ps((y - e.by) * e.bcdelx);
+    __m256 carow = _mm256_set1_ps((y - e.cy) * e.cadelx);
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 px = _mm256_add_ps(_mm256_set1_ps(x + (float)i), steps);
+        __m256 ab = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(px, ax), abdely), abrow);
+        __m256 bc = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(px, bx), bcdely), bcrow);
+        __m256 ca = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(px, cx), cadely), carow);
+        __m256 pos = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(ab, zero, _CMP_GE_OQ), _mm256_cmp_ps(bc, zero, _CMP_GE_OQ)), _mm256_cmp_ps(ca, zero, _CMP_GE_OQ));
+        mask |= (uint32_t)_mm256_movemask_ps(pos) << i;
+    }
+    if (count < 32) mask &= (1u << count) - 1;
+    return mask;
+}
 
-    if (depthBuffer[iy * currFrameBuffer->width + ix] < inF.gl_FragCoord.z) return;
+/* @brief Function checks if cpu supports SSE2 (always true on x86-64, not on old 32-bit cpus).
+ */
+static bool cpuHasSSE2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
 
-    colorBuffer[iy * currFrameBuffer->width * 4 + ix * 4] = r;
-    colorBuffer[iy * currFrameBuffer->width * 4 + ix * 4 + 1] = g;
-    colorBuffer[iy * currFrameBuffer->width * 4 + ix * 4 + 2] = b;
-    colorBuffer[iy * currFrameBuffer->width * 4 + ix * 4 + 3] = a;
+/* @brief Function checks if cpu and os support AVX (registers saved by xsave).
+ */
+static bool cpuHasAVX() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return false;
+    return (_xgetbv(0) & 6) == 6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
 
-    depthBuffer[iy * currFrameBuffer->width + ix] = inF.gl_FragCoord.z;
-    
+/* @brief Function picks fastest coverage kernel the cpu running us supports.
+ */
+static GPU::CoverageKernel selectCoverageKernel() {
+#ifdef GPU_X86
+#if !defined(_MSC_VER)
+    //kernel is selected from constructor, which may run before cpu model is initialized by libgcc
+    __builtin_cpu_init();
+#endif
+    if (cpuHasAVX()) return coverageAVX;
+    if (cpuHasSSE2()) return coverageSSE;
+#endif
+    return coverageScalar;
 }
 
-void GPU::createFragments(Triangle* t) {
-    uint32_t width = getFramebufferWidth();
-    uint32_t height = getFramebufferHeight();
+/* @brief Function evaluates all three edge functions in point (x, y), same arithmetic as coverage kernels.
+ */
+static void edgeFunctions(GPU::Edges const& e, float x, float y, float* f) {
+    f[0] = (x - e.ax) * e.abdely - (y - e.ay) * e.abdelx;
+    f[1] = (x - e.bx) * e.bcdely - (y - e.by) * e.bcdelx;
+    f[2] = (x - e.cx) * e.cadely - (y - e.cy) * e.cadelx;
+}
 
+void GPU::createFragments(Triangle* t, Tile* tile) {
     glm::vec4* a = &(t->point[0].gl_Position);
     glm::vec4* b = &(t->point[1].gl_Position);
     glm::vec4* c = &(t->point[2].gl_Position);
 
-    uint32_t minX = (uint32_t) std::max(std::min(std::min(std::floor(a->x), std::floor(b->x)), std::floor(c->x)), 0.f);
-    uint32_t minY = (uint32_t) std::max(std::min(std::min(std::floor(a->y), std::floor(b->y)), std::floor(c->y)), 0.f);
-    uint32_t maxX = std::min(width, (uint32_t) std::max(std::ceil(a->x), std::max(std::ceil(b->x), std::ceil(c->x))));
-    uint32_t maxY = std::min(width, (uint32_t) std::max(std::ceil(a->y), std::max(std::ceil(b->y), std::ceil(c->y))));
-
-    float abdely = b->y - a->y;
-    float abdelx = b->x - a->x;
-    float bcdely = c->y - b->y;
-    float bcdelx = c->x - b->x;
-    float cadely = a->y - c->y;
-    float cadelx = a->x - c->x;
-
-
-    //This is the worst, stupid slow version, because faster didn't work
-    float abfunc, bcfunc, cafunc;
-    for (float x = (float)minX + 0.5f; x < maxX; x += 1.f) {
-        for (float y = (float)minY + 0.5f; y < maxY; y += 1.f) {
-            abfunc = (x - a->x) * abdely - (y - a->y) * abdelx;
-            bcfunc = (x - b->x) * bcdely - (y - b->y) * bcdelx;
-            cafunc = (x - c->x) * cadely - (y - c->y) * cadelx;
-            if (abfunc < 0 && bcfunc < 0 && cafunc < 0) createFragment(t, x, y);
-            else if (abfunc >= 0 && bcfunc >= 0 && cafunc >= 0) createFragment(t, x, y);
-        }
-    }
-    return;
-
-    /* Fas version that doesn't work
-    bool first = true;
-    bool first_on_line = true;
-    bool left_to_right = true;
-
-    for (float x = (float)minX + 0.5f; x < maxX; x += 1.f) {
-        if (left_to_right) {
-            first_on_line = true;
-            for (float y = (float)minY + 0.5f; y < maxY; y += 1.f) {
-                if (first) {
-                    first = false;
-                    first_on_line = false;
-                    abfunc = (x - a->x) * abdely - (y - a->y) * abdelx;
-                    bcfunc = (x - b->x) * bcdely - (y - b->y) * bcdelx;
-                    cafunc = (x - c->x) * cadely - (y - c->y) * cadelx;
-                }
-                else if (first_on_line) {
-                    first_on_line = false;
-                    abfunc += abdely;
-                    bcfunc += bcdely;
-                    cafunc += cadely;
-                }
-                else {
-                    abfunc += abdelx;
-                    bcfunc += bcdelx;
-                    cafunc += cadelx;
-                }
-                if (abfunc >= 0 && bcfunc >= 0 && cafunc >= 0) createFragment(t, x, y);
+    //bounding box is clamped to the tile, so each tile touches only its own pixels
+    uint32_t minX = (uint32_t) std::max(std::min(std::min(std::floor(a->x), std::floor(b->x)), std::floor(c->x)), (float)tile->minX);
+    uint32_t minY = (uint32_t) std::max(std::min(std::min(std::floor(a->y), std::floor(b->y)), std::floor(c->y)), (float)tile->minY);
+    uint32_t maxX = (uint32_t) std::min(std::max(std::ceil(a->x), std::max(std::ceil(b->x), std::ceil(c->x))), (float)tile->maxX);
+    uint32_t maxY = (uint32_t) std::min(std::max(std::ceil(a->y), std::max(std::ceil(b->y), std::ceil(c->y))), (float)tile->maxY);
+
+    Edges& e = t->edges;
+    FrameBuffer* fb = currFrameBuffer;
+    uint32_t samples = fb->samples;
+    SampleOffset const* pattern = samplePattern(samples);
+    uint32_t all_samples = (1u << samples) - 1;
+    //with multisampling block bounds are tested at pixel edges, so they hold for every sample position
+    float margin = samples > 1 ? 0.5f : 0.f;
+
+    //hierarchical traversal, bounding box is walked in 8x8 blocks (aligned to screen)
+    //edge functions are monotonic in x and y (even with float rounding), so their
+    //values in corner pixels of block are min and max over the whole block
+    for (uint32_t by = minY - minY % blockSize; by < maxY; by += blockSize) {
+        uint32_t y0 = std::max(by, minY);
+        uint32_t y1 = std::min(by + blockSize, maxY);
+        for (uint32_t bx = minX - minX % blockSize; bx < maxX; bx += blockSize) {
+            uint32_t x0 = std::max(bx, minX);
+            uint32_t x1 = std::min(bx + blockSize, maxX);
+
+            float corner[4][3];
+            edgeFunctions(e, (float)x0 + 0.5f - margin, (float)y0 + 0.5f - margin, corner[0]);
+            edgeFunctions(e, (float)x1 - 0.5f + margin, (float)y0 + 0.5f - margin, corner[1]);
+            edgeFunctions(e, (float)x0 + 0.5f - margin, (float)y1 - 0.5f + margin, corner[2]);
+            edgeFunctions(e, (float)x1 - 0.5f + margin, (float)y1 - 0.5f + margin, corner[3]);
+            float lo[3], hi[3];
+            for (int i = 0; i < 3; i++) {
+                lo[i] = std::min(std::min(corner[0][i], corner[1][i]), std::min(corner[2][i], corner[3][i]));
+                hi[i] = std::max(std::max(corner[0][i], corner[1][i]), std::max(corner[2][i], corner[3][i]));
             }
-            left_to_right = false;
-        }
-        else {
-            first_on_line = true;
-            for (float y = (float)maxY - 0.5f; y > maxY; y -= 1.f) {
-                if (first_on_line) {
-                    first_on_line = false;
-                    abfunc += abdely;
-                    bcfunc += bcdely;
-                    cafunc += cadely;
+
+            //pixel is inside when all edge functions are >= 0 (edges are oriented in setUpTriangle)
+            if (hi[0] < 0 || hi[1] < 0 || hi[2] < 0) continue; //whole block outside
+            bool inside = lo[0] >= 0 && lo[1] >= 0 && lo[2] >= 0;
+
+            //hierarchical z, triangle depth lies between depths of its vertices
+            //whole block is behind everything drawn there, or in front of it (no depth reads needed)
+            uint32_t hiz = (by / blockSize) * fb->blocks_x + bx / blockSize;
+            //tolerance covers rounding of interpolated depth and quantization of unorm formats
+            float eps = hizEpsilon + fb->depth_quantum;
+            if (t->z_min - eps > fb->hiz_max[hiz]) continue;
+            bool depth_test = !(t->z_max + eps < fb->hiz_min[hiz]);
+
+            bool written = false;
+            float written_min = std::numeric_limits<float>::infinity();
+            for (uint32_t iy = y0; iy < y1; iy++) {
+                float y = (float)iy + 0.5f;
+                if (inside) {
+                    //whole block covered, no per pixel tests
+                    for (uint32_t ix = x0; ix < x1; ix++) written |= createFragment(t, (float)ix + 0.5f, y, depth_test, all_samples, written_min);
+                    continue;
+                }
+                //partially covered block is refined pixel by pixel, coverage kernel tests
+                //one sample position in whole row at once
+                uint32_t coverage[blockSize] = {};
+                for (uint32_t s = 0; s < samples; s++) {
+                    uint32_t mask = coverageKernel(e, (float)x0 + 0.5f + pattern[s].x, y + pattern[s].y, x1 - x0);
+                    while (mask) {
+                        uint32_t i = 0;
+                        while (!(mask & (1u << i))) i++;
+                        mask &= mask - 1;
+                        coverage[i] |= 1u << s;
+                    }
                 }
-                else {
-                    abfunc -= abdelx;
-                    bcfunc -= bcdelx;
-                    cafunc -= cadelx;
+                for (uint32_t i = 0; i < x1 - x0; i++) {
+                    if (coverage[i]) written |= createFragment(t, (float)(x0 + i) + 0.5f, y, depth_test, coverage[i], written_min);
                 }
-                if (abfunc >= 0 && bcfunc >= 0 && cafunc >= 0) createFragment(t, x, y);
             }
-            left_to_right = true;
+            if (!written) continue;
+            //triangle covering the whole block bounds its depth from above, samples it didn't
+            //write failed depth test, so they already hold smaller depth
+            bool whole = inside && x0 == bx && y0 == by &&
+                         x1 == std::min(bx + blockSize, fb->width) && y1 == std::min(by + blockSize, fb->height);
+            fb->update_hiz(hiz, written_min, whole ? t->z_max : std::numeric_limits<float>::infinity());
         }
-    }*/
+    }
 }
 
 void            GPU::drawTriangles         (uint32_t  nofVertices){
@@ -978,72 +1794,117 @@ void            GPU::drawTriangles         (uint32_t  nofVertices){
   /// Vertex shader a fragment shader se zvolí podle aktivního shader programu (pomocí useProgram).<br>
   /// Parametr "nofVertices" obsahuje počet vrcholů, který by se měl vykreslit (3 pro jeden trojúhelník).<br>
     
-    //buffers -> 2D graphics (unclipped triangles)
-    //as indexing mode doesn't change between function, i is also used as index to
-    //index buffer at each call or as ID in non-indexing mode
-    triangles.clear();
-    outfrags.clear();
-
-    float* depthBuffer = getFramebufferDepth();
-    for (uint64_t x = 0; x < currFrameBuffer->width; x++)
-        for (uint64_t y = 0; y < currFrameBuffer->height; y++)
-            depthBuffer[y * currFrameBuffer->width + x] = 1.f;
-
-    int n = 0;
-    for (uint32_t i = 0; i < nofVertices; i++) {
-        InVertex inv = fetchInVertex(i);
-        Triangle t;
-        currProgram->vertex_shader(t.point[n], inv, currProgram->uniforms);
-        
-        if (n < 2) n++;
-        else {
-            n = 0;
-            triangles.push_back(&t); //pushes finished triangle to list
-        }
-    }
+    drawTrianglesInstanced(nofVertices, 1);
+}
 
-    //printf("START\n\n");
-    //debugTriangles();
+/**
+ * @brief This function draws nofInstances instances of the same triangles.
+ * Vertex puller heads with divisor advance per instance, batched vertex shaders get gl_InstanceID.
+ * Instances are drawn in order, the result is the same as drawing them one by one.
+ *
+ * @param nofVertices number of vertices of one instance
+ * @param nofInstances number of instances
+ */
+void            GPU::drawTrianglesInstanced(uint32_t  nofVertices,uint32_t nofInstances){
+    DrawIndirectCommand command = { nofVertices, nofInstances, 0, 0, 0 };
+    drawCommands(&command, 1);
+}
 
-    //at this point, there is list with Triangles, each of three OutVertexes
-    //clipping here TODO
-    //triangle.gl_position.w -> clip space
+/**
+ * @brief This function draws count draw commands read from buffer.
+ * Commands are drawn in order with the same result as separate draws, but they share
+ * pipeline runs, so small draws are shaded, binned and rasterized together.
+ *
+ * @param commands buffer with tightly packed DrawIndirectCommand records
+ * @param count number of records
+ */
+void            GPU::multiDrawIndirect     (BufferID  commands,uint32_t count){
+    Buffer* buffer = buffers.find(commands);
+    if (buffer == nullptr || !buffer->usable()) return;
+    count = (uint32_t)std::min<uint64_t>(count, buffer->size() / sizeof(DrawIndirectCommand));
+    indirectCommands.resize(count);
+    if (count) memcpy(indirectCommands.data(), buffer->bytes(), count * sizeof(DrawIndirectCommand));
+    drawCommands(indirectCommands.data(), count);
+}
 
-    for (auto it = triangles.begin(); it != triangles.end(); it++) {
-        clipPlane(it);
-        if (!(*it)->valid) it = triangles.erase(it);
-        if (it == triangles.end()) break;
+/* @brief Function draws commands in order.
+   Indices of all commands are read first, then draw ranges are split to pieces (groups of instances)
+   and pieces are drawn in runs of pipeline with about runTriangles triangles.
+ */
+void GPU::drawCommands(DrawIndirectCommand const* commands, uint32_t count) {
+    //buffers -> 2D graphics (unclipped triangles)
+    drawStats = DrawStats();
+    compileVertexPuller();
+    vertexRefs.clear();
+    shadedIDs.clear();
+    drawRanges.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        if (commands[i].count >= 3 && commands[i].instance_count > 0) processVertices(commands[i]);
     }
 
-    //reshaping to normalized
-    for (Triangle* t : triangles) {
-        t->point[0].gl_Position.x /= t->point[0].gl_Position.w;
-        t->point[0].gl_Position.y /= t->point[0].gl_Position.w;
-        t->point[0].gl_Position.z /= t->point[0].gl_Position.w;
-
-        t->point[1].gl_Position.x /= t->point[1].gl_Position.w;
-        t->point[1].gl_Position.y /= t->point[1].gl_Position.w;
-        t->point[1].gl_Position.z /= t->point[1].gl_Position.w;
-
-        t->point[2].gl_Position.x /= t->point[2].gl_Position.w;
-        t->point[2].gl_Position.y /= t->point[2].gl_Position.w;
-        t->point[2].gl_Position.z /= t->point[2].gl_Position.w;
+    drawPieces.clear();
+    uint32_t nofSlots = 0;
+    uint32_t nofTriangles = 0;
+    for (uint32_t r = 0; r < drawRanges.size(); r++) {
+        DrawRange const& range = drawRanges[r];
+        uint32_t per_instance = range.nof_vertices / 3;
+        uint32_t first = 0;
+        while (first < range.nof_instances) {
+            uint32_t room = nofTriangles < runTriangles ? (runTriangles - nofTriangles) / per_instance : 0;
+            if (room == 0 && !drawPieces.empty()) {
+                runPipeline(nofSlots, nofTriangles);
+                drawPieces.clear();
+                nofSlots = 0;
+                nofTriangles = 0;
+                continue;
+            }
+            DrawPiece piece;
+            piece.range = r;
+            piece.first_instance = first;
+            piece.nof_instances = std::min(std::max(room, 1u), range.nof_instances - first);
+            piece.slot = nofSlots;
+            piece.triangle = nofTriangles;
+            drawPieces.push_back(piece);
+            nofSlots += piece.nof_instances * range.nof_shaded;
+            nofTriangles += piece.nof_instances * per_instance;
+            first += piece.nof_instances;
+        }
     }
+    if (!drawPieces.empty()) runPipeline(nofSlots, nofTriangles);
+}
 
-    uint32_t width = currFrameBuffer->width;
-    uint32_t height = currFrameBuffer->height;
-
-    //resizing to screen size
-    for (Triangle* t : triangles) {
-        t->point[0].gl_Position.x = (t->point[0].gl_Position.x + 1.f) / 2.f * width;
-        t->point[0].gl_Position.y = (t->point[0].gl_Position.y + 1.f) / 2.f * height;
-        t->point[1].gl_Position.x = (t->point[1].gl_Position.x + 1.f) / 2.f * width;
-        t->point[1].gl_Position.y = (t->point[1].gl_Position.y + 1.f) / 2.f * height;
-        t->point[2].gl_Position.x = (t->point[2].gl_Position.x + 1.f) / 2.f * width;
-        t->point[2].gl_Position.y = (t->point[2].gl_Position.y + 1.f) / 2.f * height;
+/* @brief Function runs the pipeline for drawPieces.
+   @param nofSlots number of vertices to shade
+   @param nofTriangles number of triangles
+ */
+void GPU::runPipeline(uint32_t nofSlots, uint32_t nofTriangles) {
+    //shading runs in chunks on the pool, every chunk writes its own part of outVertices
+    outVertices.resize(nofSlots);
+    uint32_t vertexChunks = (nofSlots + vertexChunk - 1) / vertexChunk;
+    pool.run(vertexChunks, [this, nofSlots](uint32_t c) {
+        shadeVertices(c * vertexChunk, std::min((c + 1) * vertexChunk, nofSlots));
+    });
+
+    //assembly, clipping, projection and setup run in chunks of triangles on the pool,
+    //each chunk only writes its own part of triangles
+    triangles.resize(nofTriangles);
+    uint32_t chunks = (nofTriangles + triangleChunk - 1) / triangleChunk;
+    if (clippedTriangles.size() < chunks) clippedTriangles.resize(chunks);
+    pool.run(chunks, [this](uint32_t c) { processTriangles(c); });
+
+    //sort-middle: bin triangles into tiles (in order), then every tile is rasterized by one thread
+    //triangles made by clipping follow the triangle they were clipped from
+    setUpTiles();
+    for (uint32_t i = 0; i < nofTriangles; i++) {
+        Triangle* t = &triangles[i];
+        if (t->valid) binTriangle(t);
+        std::vector<Triangle>& clipped = clippedTriangles[i / triangleChunk];
+        for (uint32_t k = t->clip_first; k < t->clip_first + t->clip_count; k++) {
+            if (clipped[k].valid) binTriangle(&clipped[k]);
+        }
     }
-
-    for (Triangle* t : triangles) createFragments(t);
+    pool.run((uint32_t)tiles.size(), [this](uint32_t i) { rasterizeTile(&tiles[i]); });
+    drawArena.reset();
 
 
     /* //draw test 
@@ -1068,11 +1929,954 @@ void            GPU::drawTriangles         (uint32_t  nofVertices){
     }*/
 }
 
+/**
+ * @brief This function returns statistics of last draw call.
+ *
+ * @return counters of last draw
+ */
+GPU::DrawStats const& GPU::getDrawStats(){
+    return drawStats;
+}
+
+/**
+ * @brief This function sets size of guard band.
+ * Triangles crossing left/right/bottom/top planes are not clipped while they stay inside it.
+ *
+ * @param guard guard band as multiple of view volume (x and y up to guard * w), at least 1
+ */
+void            GPU::setGuardBand          (float     guard){
+    guardBand = std::max(guard, 1.f);
+}
+
+/**
+ * @brief This function selects which faces are culled.
+ *
+ * @param face culled faces (NONE by default)
+ */
+void            GPU::setCullFace           (CullFace  face){
+    cullFace = face;
+}
+
+/**
+ * @brief This function selects winding of front facing triangles (in screen space, y going up).
+ *
+ * @param face front face winding (CCW by default)
+ */
+void            GPU::setFrontFace          (FrontFace face){
+    frontFace = face;
+}
+
+/**
+ * @brief This function enables culling of triangles that cover no pixel center.
+ *
+ * @param enabled true to cull them (default)
+ */
+void            GPU::setSmallPrimitiveCulling(bool     enabled){
+    smallPrimitiveCulling = enabled;
+}
+
+/**
+ * @brief This function sets how many threads rasterize tiles.
+ *
+ * @param nofThreads number of threads including the calling one (0 means one per core)
+ */
+void            GPU::setThreadCount        (uint32_t  nofThreads){
+    if (nofThreads == 0) nofThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    pool.finish();
+    pool.start(nofThreads - 1);
+}
+
+/**
+ * @brief This function executes commands recorded in command list.
+ * The result is the same as calling the commands directly, except that opaque draws
+ * between two barriers are reordered: they are grouped by program and vertex puller
+ * (each with uniforms it was recorded with) and sorted front-to-back inside groups,
+ * so early z rejects more fragments. Opaque draws must not depend on their order,
+ * i.e. they may not write equal depth to the same pixel.
+ *
+ * @param list recorded commands, list is not changed and can be submitted again
+ */
+void            GPU::submit                (CommandList const& list){
+    std::vector<CommandList::Command> const& commands = list.commands;
+    uint32_t i = 0;
+    while (i < commands.size()) {
+        if (commands[i].type != CommandList::Type::DRAW_OPAQUE) {
+            executeCommand(commands[i]);
+            i++;
+            continue;
+        }
+        //segment ends at the next barrier, state commands inside it are applied to its draws
+        uint32_t end = i;
+        while (end < commands.size() && commands[end].type != CommandList::Type::CLEAR && commands[end].type != CommandList::Type::DRAW) end++;
+        submitOpaque(&commands[i], end - i);
+        i = end;
+    }
+}
+
+/* @brief Function executes one command of command list in order.
+ */
+void GPU::executeCommand(CommandList::Command const& command) {
+    if (command.type == CommandList::Type::BIND_VERTEX_PULLER) bindVertexPuller(command.object);
+    else if (command.type == CommandList::Type::USE_PROGRAM) useProgram(command.object);
+    else if (command.type == CommandList::Type::UNIFORM) {
+        Program* program = programs.find(command.object);
+        if (program != nullptr) memcpy(&program->uniforms.uniform[command.uniform], &command.value, command.floats * sizeof(float));
+    }
+    else if (command.type == CommandList::Type::CLEAR) clear(command.value.v4.r, command.value.v4.g, command.value.v4.b, command.value.v4.a);
+    else drawTrianglesInstanced(command.nof_vertices, command.nof_instances);
+}
+
+/* @brief Function returns uniforms of program pending in current segment, nullptr if it has none yet.
+ */
+GPU::PendingUniforms* GPU::findPendingUniforms(Program* program) {
+    for (PendingUniforms& pending : pendingUniforms) {
+        if (pending.program == program) return &pending;
+    }
+    return nullptr;
+}
+
+/* @brief Function draws segment of command list without barriers, opaque draws are sorted.
+   Commands are first walked in order to find state and uniforms of every draw, GPU state after
+   the segment is the same as after executing it in order.
+ */
+void GPU::submitOpaque(CommandList::Command const* commands, uint32_t count) {
+    sortedDraws.clear();
+    sortedUniforms.clear();
+    pendingUniforms.clear();
+    rankedPrograms.clear();
+    rankedPullers.clear();
+
+    for (uint32_t i = 0; i < count; i++) {
+        CommandList::Command const& command = commands[i];
+        if (command.type == CommandList::Type::BIND_VERTEX_PULLER) currVertexPuller = vertexPullers.find(command.object);
+        else if (command.type == CommandList::Type::USE_PROGRAM) {
+            Program* program = programs.find(command.object);
+            if (program != nullptr) currProgram = program;
+        }
+        else if (command.type == CommandList::Type::UNIFORM) {
+            Program* program = programs.find(command.object);
+            if (program == nullptr) continue;
+            PendingUniforms* pending = findPendingUniforms(program);
+            if (pending == nullptr) {
+                pendingUniforms.emplace_back();
+                pending = &pendingUniforms.back();
+                pending->program = program;
+                pending->uniforms = program->uniforms;
+            }
+            memcpy(&pending->uniforms.uniform[command.uniform], &command.value, command.floats * sizeof(float));
+            pending->dirty = true;
+        }
+        else if (command.nof_vertices >= 3 && command.nof_instances > 0 && currProgram != nullptr && currVertexPuller != nullptr) {
+            PendingUniforms* pending = findPendingUniforms(currProgram);
+            if (pending == nullptr) {
+                pendingUniforms.emplace_back();
+                pending = &pendingUniforms.back();
+                pending->program = currProgram;
+                pending->uniforms = currProgram->uniforms;
+                pending->dirty = true;
+            }
+            if (pending->dirty) {
+                pending->snapshot = (uint32_t)sortedUniforms.size();
+                pending->dirty = false;
+                sortedUniforms.push_back(pending->uniforms);
+            }
+
+            SortedDraw draw;
+            draw.program = currProgram;
+            draw.puller = currVertexPuller;
+            draw.uniforms = pending->snapshot;
+            draw.program_rank = (uint32_t)(std::find(rankedPrograms.begin(), rankedPrograms.end(), currProgram) - rankedPrograms.begin());
+            if (draw.program_rank == rankedPrograms.size()) rankedPrograms.push_back(currProgram);
+            draw.puller_rank = (uint32_t)(std::find(rankedPullers.begin(), rankedPullers.end(), currVertexPuller) - rankedPullers.begin());
+            if (draw.puller_rank == rankedPullers.size()) rankedPullers.push_back(currVertexPuller);
+            draw.depth = command.depth;
+            draw.order = i;
+            draw.nof_vertices = command.nof_vertices;
+            draw.nof_instances = command.nof_instances;
+            sortedDraws.push_back(draw);
+        }
+    }
+
+    std::sort(sortedDraws.begin(), sortedDraws.end(), [](SortedDraw const& a, SortedDraw const& b) {
+        if (a.program_rank != b.program_rank) return a.program_rank < b.program_rank;
+        if (a.puller_rank != b.puller_rank) return a.puller_rank < b.puller_rank;
+        if (a.depth != b.depth) return a.depth < b.depth;
+        return a.order < b.order;
+    });
+
+    //state after the segment, draws below change it
+    Program* program = currProgram;
+    VertexPuller* puller = currVertexPuller;
+    uint32_t i = 0;
+    while (i < sortedDraws.size()) {
+        SortedDraw const& draw = sortedDraws[i];
+        currProgram = draw.program;
+        currVertexPuller = draw.puller;
+        currProgram->uniforms = sortedUniforms[draw.uniforms];
+        sortedCommands.clear();
+        while (i < sortedDraws.size() && sortedDraws[i].program == draw.program && sortedDraws[i].puller == draw.puller && sortedDraws[i].uniforms == draw.uniforms) {
+            DrawIndirectCommand command = { sortedDraws[i].nof_vertices, sortedDraws[i].nof_instances, 0, 0, 0 };
+            sortedCommands.push_back(command);
+            i++;
+        }
+        drawCommands(sortedCommands.data(), (uint32_t)sortedCommands.size());
+    }
+    currProgram = program;
+    currVertexPuller = puller;
+    for (PendingUniforms const& pending : pendingUniforms) pending.program->uniforms = pending.uniforms;
+}
+
+/**
+ * @brief This function records binding of vertex puller.
+ *
+ * @param vao vertex puller id
+ */
+void      CommandList::bindVertexPuller       (VertexPullerID vao){
+    add(Type::BIND_VERTEX_PULLER).object = vao;
+}
+
+/**
+ * @brief This function records activation of shader program.
+ *
+ * @param prg shader program id
+ */
+void      CommandList::useProgram             (ProgramID prg){
+    add(Type::USE_PROGRAM).object = prg;
+}
+
+/**
+ * @brief This function records setting of uniform value (1 float).
+ *
+ * @param prg shader program
+ * @param uniformId id of uniform value (number of uniform values is stored in maxUniforms variable)
+ * @param d value of uniform variable
+ */
+void      CommandList::programUniform1f       (ProgramID prg,uint32_t uniformId,float     const&d){
+    uniform(prg, uniformId, &d, 1);
+}
+
+/**
+ * @brief This function records setting of uniform value (2 float).
+ *
+ * @param prg shader program
+ * @param uniformId id of uniform value (number of uniform values is stored in maxUniforms variable)
+ * @param d value of uniform variable
+ */
+void      CommandList::programUniform2f       (ProgramID prg,uint32_t uniformId,glm::vec2 const&d){
+    uniform(prg, uniformId, &d, 2);
+}
+
+/**
+ * @brief This function records setting of uniform value (3 float).
+ *
+ * @param prg shader program
+ * @param uniformId id of uniform value (number of uniform values is stored in maxUniforms variable)
+ * @param d value of uniform variable
+ */
+void      CommandList::programUniform3f       (ProgramID prg,uint32_t uniformId,glm::vec3 const&d){
+    uniform(prg, uniformId, &d, 3);
+}
+
+/**
+ * @brief This function records setting of uniform value (4 float).
+ *
+ * @param prg shader program
+ * @param uniformId id of uniform value (number of uniform values is stored in maxUniforms variable)
+ * @param d value of uniform variable
+ */
+void      CommandList::programUniform4f       (ProgramID prg,uint32_t uniformId,glm::vec4 const&d){
+    uniform(prg, uniformId, &d, 4);
+}
+
+/**
+ * @brief This function records setting of uniform value (4x4 matrix).
+ *
+ * @param prg shader program
+ * @param uniformId id of uniform value (number of uniform values is stored in maxUniforms variable)
+ * @param d value of uniform variable
+ */
+void      CommandList::programUniformMatrix4f (ProgramID prg,uint32_t uniformId,glm::mat4 const&d){
+    uniform(prg, uniformId, &d, 16);
+}
+
+/**
+ * @brief This function records clear of framebuffer, it's a barrier for sorting of opaque draws.
+ *
+ * @param r red channel
+ * @param g green channel
+ * @param b blue channel
+ * @param a alpha channel
+ */
+void      CommandList::clear                  (float r,float g,float b,float a){
+    add(Type::CLEAR).value.v4 = glm::vec4(r, g, b, a);
+}
+
+/**
+ * @brief This function records draw that keeps its place, it's a barrier for sorting of opaque draws.
+ *
+ * @param nofVertices number of vertices
+ */
+void      CommandList::drawTriangles          (uint32_t  nofVertices){
+    drawTrianglesInstanced(nofVertices, 1);
+}
+
+/**
+ * @brief This function records instanced draw that keeps its place, it's a barrier for sorting of opaque draws.
+ *
+ * @param nofVertices number of vertices of one instance
+ * @param nofInstances number of instances
+ */
+void      CommandList::drawTrianglesInstanced (uint32_t  nofVertices,uint32_t nofInstances){
+    Command& command = add(Type::DRAW);
+    command.nof_vertices = nofVertices;
+    command.nof_instances = nofInstances;
+}
+
+/**
+ * @brief This function records opaque draw, which submit may reorder.
+ *
+ * @param nofVertices number of vertices of one instance
+ * @param depth distance of draw from camera (e.g. of center of its bounds), nearer draws go first
+ * @param nofInstances number of instances
+ */
+void      CommandList::drawOpaque             (uint32_t  nofVertices,float depth,uint32_t nofInstances){
+    Command& command = add(Type::DRAW_OPAQUE);
+    command.nof_vertices = nofVertices;
+    command.nof_instances = nofInstances;
+    command.depth = depth;
+}
+
+/**
+ * @brief This function removes all recorded commands, memory is kept for recording next ones.
+ */
+void      CommandList::reset                  (){
+    commands.clear();
+}
+
+/* @brief Function appends command of given type.
+ */
+CommandList::Command& CommandList::add(Type type) {
+    commands.emplace_back();
+    commands.back().type = type;
+    return commands.back();
+}
+
+/* @brief Function appends setting of uniform, floats first floats of data are copied to it.
+ */
+void CommandList::uniform(ProgramID prg, uint32_t uniformId, void const* data, uint32_t floats) {
+    Command& command = add(Type::UNIFORM);
+    command.object = prg;
+    command.uniform = uniformId;
+    command.floats = floats;
+    memcpy(&command.value, data, floats * sizeof(float));
+}
+
 /// @}
 
+/* @brief Function sets up per block and per tile bookkeeping of framebuffer
+   (hierarchical z and lazy clear flags) for its current size.
+   Buffers were just (re)allocated, so all tiles wait for clear values as after lazy clear,
+   otherwise draw before first clear would test against zeroed depth.
+ */
+void GPU::FrameBuffer::set_up_blocks() {
+    blocks_x = (width + blockSize - 1) / blockSize;
+    blocks_y = (height + blockSize - 1) / blockSize;
+    hiz_min.resize((size_t)blocks_x * blocks_y);
+    hiz_max.resize((size_t)blocks_x * blocks_y);
+    reset_hiz(clear_depth);
+    tiles_x = (width + tileSize - 1) / tileSize;
+    tiles_y = (height + tileSize - 1) / tileSize;
+    tile_pending.assign((size_t)tiles_x * tiles_y, 1);
+}
+
+/* @brief Function writes clear values to rectangle of color and depth buffer.
+   @param stream use non-temporal stores (fenced once at the end), only for eager clear of whole buffer,
+   tiles of lazy clear are drawn to right away, so they are filled through the cache
+ */
+void GPU::FrameBuffer::fill(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, bool stream) {
+    bool whole = stream && x0 == 0 && y0 == 0 && x1 == width && y1 == height;
+    if (layout == FramebufferLayout::MORTON_BLOCKS) {
+        //rectangle starts on block (tile) corner, blocks of one block row are continuous
+        uint32_t bx0 = x0 / blockSize;
+        uint32_t bx1 = (x1 + blockSize - 1) / blockSize;
+        uint32_t by1 = (y1 + blockSize - 1) / blockSize;
+        size_t block_pixels = blockSize * blockSize;
+        if (bx0 == 0 && bx1 == blocks_x) {
+            size_t begin = (size_t)(y0 / blockSize) * blocks_x * block_pixels;
+            size_t count = (size_t)(by1 - y0 / blockSize) * blocks_x * block_pixels;
+            fill_colors(begin, count, whole);
+            fill_depth(begin, count, whole);
+            if (whole) streamFence();
+            return;
+        }
+        for (uint32_t by = y0 / blockSize; by < by1; by++) {
+            size_t begin = ((size_t)by * blocks_x + bx0) * block_pixels;
+            fill_colors(begin, (bx1 - bx0) * block_pixels, false);
+            fill_depth(begin, (bx1 - bx0) * block_pixels, false);
+        }
+        return;
+    }
+    if (x0 == 0 && x1 == width) {
+        //whole rows are one continuous block
+        size_t begin = (size_t)y0 * width;
+        size_t count = (size_t)(y1 - y0) * width;
+        fill_colors(begin, count, whole);
+        fill_depth(begin, count, whole);
+        if (whole) streamFence();
+        return;
+    }
+    for (uint32_t y = y0; y < y1; y++) {
+        size_t begin = (size_t)y * width + x0;
+        fill_colors(begin, x1 - x0, false);
+        fill_depth(begin, x1 - x0, false);
+    }
+}
+
+/* @brief Function converts color component to unsigned normalized integer with given maximum,
+   values outside of [0,1] are clamped.
+ */
+static uint32_t colorToUnorm(float c, uint32_t max) {
+    if (!(c > 0.f)) return 0;
+    if (c >= 1.f) return max;
+    return (uint32_t)round(c * (float)max);
+}
+
+/* @brief Function converts float to half float (round to nearest even, overflow goes to infinity).
+ */
+static uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(uint32_t));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+    if (exponent == 0xff) return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    int32_t e = (int32_t)exponent - 127 + 15;
+    if (e >= 31) return (uint16_t)(sign | 0x7c00);
+    uint32_t shift = 13;
+    uint32_t h = 0;
+    if (e <= 0) {
+        //denormal half
+        if (e < -10) return (uint16_t)sign;
+        mantissa |= 0x800000;
+        shift = 14 - e;
+    }
+    else h = (uint32_t)e << 10;
+    h |= mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    //carry may go to exponent, which is still correct rounding
+    if (rest > halfway || (rest == halfway && (h & 1))) h++;
+    return (uint16_t)(sign | h);
+}
+
+/* @brief Color writers, one per ColorFormat.
+ */
+static void writeRGBA8(uint8_t* data, size_t pixel, glm::vec4 const& c) {
+    uint8_t* p = data + pixel * 4;
+    p[0] = (uint8_t)colorToUnorm(c.r, 255);
+    p[1] = (uint8_t)colorToUnorm(c.g, 255);
+    p[2] = (uint8_t)colorToUnorm(c.b, 255);
+    p[3] = (uint8_t)colorToUnorm(c.a, 255);
+}
+
+static void writeRGB565(uint8_t* data, size_t pixel, glm::vec4 const& c) {
+    ((uint16_t*)data)[pixel] = (uint16_t)(colorToUnorm(c.r, 31) << 11 | colorToUnorm(c.g, 63) << 5 | colorToUnorm(c.b, 31));
+}
+
+static void writeRGBA4(uint8_t* data, size_t pixel, glm::vec4 const& c) {
+    ((uint16_t*)data)[pixel] = (uint16_t)(colorToUnorm(c.r, 15) << 12 | colorToUnorm(c.g, 15) << 8 |
+                                          colorToUnorm(c.b, 15) << 4 | colorToUnorm(c.a, 15));
+}
+
+static void writeRGBA16F(uint8_t* data, size_t pixel, glm::vec4 const& c) {
+    uint16_t* p = (uint16_t*)data + pixel * 4;
+    p[0] = floatToHalf(c.r);
+    p[1] = floatToHalf(c.g);
+    p[2] = floatToHalf(c.b);
+    p[3] = floatToHalf(c.a);
+}
+
+static void writeRGBA32F(uint8_t* data, size_t pixel, glm::vec4 const& c) {
+    float rgba[4] = { c.r, c.g, c.b, c.a };
+    memcpy(data + pixel * 16, rgba, sizeof(rgba));
+}
+
+/* @brief Function converts half float to float.
+ */
+static float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    float f;
+    if (exponent == 0) {
+        //zero or denormal
+        f = ldexpf((float)mantissa, -24);
+        uint32_t x;
+        memcpy(&x, &f, sizeof(uint32_t));
+        x |= sign;
+        memcpy(&f, &x, sizeof(uint32_t));
+        return f;
+    }
+    uint32_t x;
+    if (exponent == 0x1f) x = sign | 0x7f800000 | (mantissa << 13);
+    else x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    memcpy(&f, &x, sizeof(uint32_t));
+    return f;
+}
+
+/* @brief Function reads one pixel of color buffer in given format.
+ */
+static glm::vec4 readColor(ColorFormat format, uint8_t const* p) {
+    if (format == ColorFormat::RGB565) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(uint16_t));
+        return glm::vec4((v >> 11) / 31.f, ((v >> 5) & 63) / 63.f, (v & 31) / 31.f, 1.f);
+    }
+    if (format == ColorFormat::RGBA4) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(uint16_t));
+        return glm::vec4((v >> 12) / 15.f, ((v >> 8) & 15) / 15.f, ((v >> 4) & 15) / 15.f, (v & 15) / 15.f);
+    }
+    if (format == ColorFormat::RGBA16F) {
+        uint16_t v[4];
+        memcpy(v, p, sizeof(v));
+        return glm::vec4(halfToFloat(v[0]), halfToFloat(v[1]), halfToFloat(v[2]), halfToFloat(v[3]));
+    }
+    if (format == ColorFormat::RGBA32F) {
+        float v[4];
+        memcpy(v, p, sizeof(v));
+        return glm::vec4(v[0], v[1], v[2], v[3]);
+    }
+    return glm::vec4(p[0] / 255.f, p[1] / 255.f, p[2] / 255.f, p[3] / 255.f);
+}
+
+/* @brief Function averages 4 or 8 RGBA8 samples (rounded to nearest).
+   On x86-64 all samples are summed at once in 16-bit lanes.
+ */
+static void resolveRGBA8(uint8_t const* in, uint32_t samples, uint8_t* out) {
+    uint32_t shift = samples == 8 ? 3 : 2;
+#if defined(__x86_64__) || defined(_M_X64)
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (uint32_t s = 0; s < samples; s += 4) {
+        __m128i v = _mm_loadu_si128((__m128i const*)(in + s * 4));
+        sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+    }
+    //lanes hold two pixels worth of sums, fold them together
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_add_epi16(sum, _mm_set1_epi16((short)(samples / 2)));
+    sum = _mm_srl_epi16(sum, _mm_cvtsi32_si128((int)shift));
+    int packed = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(out, &packed, sizeof(int));
+#else
+    for (uint32_t c = 0; c < 4; c++) {
+        uint32_t sum = samples / 2;
+        for (uint32_t s = 0; s < samples; s++) sum += in[s * 4 + c];
+        out[c] = (uint8_t)(sum >> shift);
+    }
+#endif
+}
+
+/* @brief Function selects color format and its writer.
+ */
+void GPU::ColorBuffer::set_up(ColorFormat new_format) {
+    format = new_format;
+    if (format == ColorFormat::RGB565) write = writeRGB565;
+    else if (format == ColorFormat::RGBA4) write = writeRGBA4;
+    else if (format == ColorFormat::RGBA16F) write = writeRGBA16F;
+    else if (format == ColorFormat::RGBA32F) write = writeRGBA32F;
+    else write = writeRGBA8;
+}
+
+/* @brief Function writes clear color to count pixels (samples) starting at begin.
+   @param stream use non-temporal stores where format allows (caller fences)
+ */
+void GPU::ColorBuffer::fill(size_t begin, size_t count, bool stream) {
+    uint8_t* data = buffer.data();
+    uint32_t bytes = this->bytes();
+    if (bytes == 2) {
+        uint16_t value;
+        memcpy(&value, clear_color, sizeof(uint16_t));
+        std::fill_n((uint16_t*)data + begin, count, value);
+    }
+    else if (bytes == 4) {
+        uint32_t value;
+        memcpy(&value, clear_color, sizeof(uint32_t));
+        if (stream) streamFill((uint32_t*)data + begin, value, count);
+        else std::fill_n((uint32_t*)data + begin, count, value);
+    }
+    else if (bytes == 8) {
+        uint64_t value;
+        memcpy(&value, clear_color, sizeof(uint64_t));
+        std::fill_n((uint64_t*)data + begin, count, value);
+    }
+    else {
+        for (size_t i = begin; i < begin + count; i++) memcpy(data + i * bytes, clear_color, bytes);
+    }
+}
+
+/* @brief Function writes clear color of every color attachment to count pixels (all their samples) starting at begin.
+ */
+void GPU::FrameBuffer::fill_colors(size_t begin, size_t count, bool stream) {
+    for (ColorBuffer& color : colors) color.fill(begin * samples, count * samples, stream);
+}
+
+/* @brief Function writes color to samples of pixel in mask, it's packed only once.
+ */
+void GPU::ColorBuffer::write_samples(size_t first, uint32_t mask, glm::vec4 const& color) {
+    uint32_t bytes = this->bytes();
+    uint8_t* data = buffer.data();
+    uint8_t const* packed = nullptr;
+    for (uint32_t s = 0; mask; s++, mask >>= 1) {
+        if (!(mask & 1)) continue;
+        if (packed == nullptr) {
+            write(data, first + s, color);
+            packed = data + (first + s) * bytes;
+        }
+        else memcpy(data + (first + s) * bytes, packed, bytes);
+    }
+}
+
+/* @brief Function converts NDC z to unsigned normalized window depth with given maximum.
+ */
+static uint32_t depthToUnorm(float z, uint32_t max) {
+    float d = std::min(std::max((z + 1.f) * 0.5f, 0.f), 1.f);
+    return (uint32_t)(d * (float)max + 0.5f);
+}
+
+/* @brief Function returns depth of sample as NDC z.
+ */
+float GPU::FrameBuffer::read_depth(size_t sample) const {
+    uint8_t const* data = depth_buffer.data();
+    if (depth_format == DepthFormat::D16) return ((uint16_t const*)data)[sample] / 65535.f * 2.f - 1.f;
+    if (depth_format == DepthFormat::D24) return ((uint32_t const*)data)[sample] / 16777215.f * 2.f - 1.f;
+    return ((float const*)data)[sample];
+}
+
+/* @brief Function tests fragment depth against sample (less or equal), in precision of the format.
+ */
+bool GPU::FrameBuffer::depth_passes(size_t sample, float z) const {
+    uint8_t const* data = depth_buffer.data();
+    if (depth_format == DepthFormat::D16) return depthToUnorm(z, 65535) <= ((uint16_t const*)data)[sample];
+    if (depth_format == DepthFormat::D24) return depthToUnorm(z, 16777215) <= ((uint32_t const*)data)[sample];
+    return !(((float const*)data)[sample] < z);
+}
+
+/* @brief Function stores depth of sample.
+ */
+void GPU::FrameBuffer::write_depth(size_t sample, float z) {
+    uint8_t* data = depth_buffer.data();
+    if (depth_format == DepthFormat::D16) ((uint16_t*)data)[sample] = (uint16_t)depthToUnorm(z, 65535);
+    else if (depth_format == DepthFormat::D24) ((uint32_t*)data)[sample] = depthToUnorm(z, 16777215);
+    else ((float*)data)[sample] = z;
+}
+
+/* @brief Function writes clear depth to count pixels (all their samples) starting at begin.
+ */
+void GPU::FrameBuffer::fill_depth(size_t begin, size_t count, bool stream) {
+    uint8_t* data = depth_buffer.data();
+    begin *= samples;
+    count *= samples;
+    if (depth_format == DepthFormat::D16) {
+        std::fill_n((uint16_t*)data + begin, count, (uint16_t)depthToUnorm(clear_depth, 65535));
+        return;
+    }
+    uint32_t value;
+    if (depth_format == DepthFormat::D24) value = depthToUnorm(clear_depth, 16777215);
+    else memcpy(&value, &clear_depth, sizeof(uint32_t));
+    if (stream) streamFill((uint32_t*)data + begin, value, count);
+    else std::fill_n((uint32_t*)data + begin, count, value);
+}
+
+/* @brief Function writes pending clear values to one tile (lazy clear).
+   Each tile is resolved only by thread that owns it.
+ */
+void GPU::FrameBuffer::resolve_tile(uint32_t tx, uint32_t ty) {
+    uint8_t& pending = tile_pending[ty * tiles_x + tx];
+    if (!pending) return;
+    fill(tx * tileSize, ty * tileSize, std::min((tx + 1) * tileSize, width), std::min((ty + 1) * tileSize, height), false);
+    pending = 0;
+}
+
+/* @brief Function writes pending clear values to all tiles, before buffers are read back.
+ */
+void GPU::FrameBuffer::resolve() {
+    for (uint32_t ty = 0; ty < tiles_y; ty++)
+        for (uint32_t tx = 0; tx < tiles_x; tx++)
+            resolve_tile(tx, ty);
+}
+
+/* @brief Function copies buffer with pixels of given size in current layout to linear (row by row) buffer.
+ */
+void GPU::FrameBuffer::to_linear(std::vector<uint8_t> const& src, uint32_t bytes, std::vector<uint8_t>& dst) const {
+    dst.resize((size_t)width * height * bytes);
+    uint8_t* out = dst.data();
+    for (uint32_t y = 0; y < height; y++)
+        for (uint32_t x = 0; x < width; x++, out += bytes)
+            memcpy(out, src.data() + pixel_index(x, y) * bytes, bytes);
+}
+
+/* @brief Function copies linear buffer with pixels of given size to buffer in current layout.
+ */
+void GPU::FrameBuffer::from_linear(std::vector<uint8_t> const& src, uint32_t bytes, std::vector<uint8_t>& dst) const {
+    dst.resize(stored_pixels() * bytes);
+    uint8_t const* in = src.data();
+    for (uint32_t y = 0; y < height; y++)
+        for (uint32_t x = 0; x < width; x++, in += bytes)
+            memcpy(dst.data() + pixel_index(x, y) * bytes, in, bytes);
+}
+
+/* @brief Function returns color attachment as linear single sampled buffer,
+   copy is made only for MORTON_BLOCKS layout or multisampling.
+ */
+uint8_t* GPU::FrameBuffer::linear_color(uint32_t attachment) {
+    ColorBuffer& color = colors[attachment];
+    if (samples > 1) {
+        resolve_samples(color);
+        return color.readback.data();
+    }
+    if (layout == FramebufferLayout::LINEAR) return color.buffer.data();
+    to_linear(color.buffer, color.bytes(), color.readback);
+    return color.readback.data();
+}
+
+/* @brief Function averages samples of every pixel of color attachment into linear readback buffer.
+ */
+void GPU::FrameBuffer::resolve_samples(ColorBuffer& color) const {
+    uint32_t bytes = color.bytes();
+    color.readback.resize((size_t)width * height * bytes);
+    uint8_t* out = color.readback.data();
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++, out += bytes) {
+            uint8_t const* in = color.buffer.data() + pixel_index(x, y) * samples * bytes;
+            if (color.format == ColorFormat::RGBA8) {
+                resolveRGBA8(in, samples, out);
+                continue;
+            }
+            glm::vec4 sum(0.f);
+            for (uint32_t s = 0; s < samples; s++) sum += readColor(color.format, in + s * bytes);
+            color.write(out, 0, sum / (float)samples);
+        }
+    }
+}
+
+/* @brief Function changes memory layout of color and depth buffer, pixels are moved to new places.
+ */
+void GPU::FrameBuffer::set_layout(FramebufferLayout new_layout) {
+    if (layout == new_layout) return;
+    resolve();
+    std::vector<std::vector<uint8_t>> linear_colors(colors.size());
+    std::vector<uint8_t> depth;
+    //samples of pixel are moved together as one bigger pixel
+    for (size_t i = 0; i < colors.size(); i++) to_linear(colors[i].buffer, colors[i].bytes() * samples, linear_colors[i]);
+    to_linear(depth_buffer, depth_bytes() * samples, depth);
+    layout = new_layout;
+    for (size_t i = 0; i < colors.size(); i++) from_linear(linear_colors[i], colors[i].bytes() * samples, colors[i].buffer);
+    from_linear(depth, depth_bytes() * samples, depth_buffer);
+}
+
+/* @brief Function tests if other framebuffer has same size, formats and layout.
+ */
+bool GPU::FrameBuffer::same_shape(FrameBuffer const& other) const {
+    if (width != other.width || height != other.height || layout != other.layout || samples != other.samples) return false;
+    if (depth_format != other.depth_format || colors.size() != other.colors.size()) return false;
+    for (size_t i = 0; i < colors.size(); i++) {
+        if (colors[i].format != other.colors[i].format) return false;
+    }
+    return true;
+}
+
+/* @brief Function allocates buffers of same size, formats and layout as other framebuffer has.
+ */
+void GPU::FrameBuffer::set_up_like(FrameBuffer const& other) {
+    std::vector<ColorFormat> formats;
+    for (ColorBuffer const& color : other.colors) formats.push_back(color.format);
+    *this = FrameBuffer();
+    layout = other.layout;
+    samples = other.samples;
+    set_up(other.width, other.height, other.depth_format, (uint32_t)formats.size(), formats.data());
+}
+
+/* @brief Function sets whole hierarchical z to depth the depth buffer was cleared to.
+ */
+void GPU::FrameBuffer::reset_hiz(float depth) {
+    //unorm formats store clamped depth (quantization is covered by tolerance of the tests)
+    if (depth_format != DepthFormat::D32F) depth = std::min(std::max(depth, -1.f), 1.f);
+    std::fill(hiz_min.begin(), hiz_min.end(), depth);
+    std::fill(hiz_max.begin(), hiz_max.end(), depth);
+}
+
+/* @brief Function updates min and max depth of block after triangle was drawn to it, without reading depth buffer.
+   Depths only decrease (LEQUAL), so both bounds stay conservative.
+   @param written_min lowest depth written to the block
+   @param covered_max max depth of triangle covering whole block, infinity if it covered only part of it
+ */
+void GPU::FrameBuffer::update_hiz(uint32_t block, float written_min, float covered_max) {
+    hiz_min[block] = std::min(hiz_min[block], written_min);
+    hiz_max[block] = std::min(hiz_max[block], covered_max);
+}
+
+/* @brief Function splits current framebuffer into tiles and empties their bins.
+ */
+void GPU::setUpTiles() {
+    uint32_t width = currFrameBuffer->width;
+    uint32_t height = currFrameBuffer->height;
+    tilesX = (width + tileSize - 1) / tileSize;
+    tilesY = (height + tileSize - 1) / tileSize;
+    tiles.resize((size_t)tilesX * tilesY);
+
+    for (uint32_t ty = 0; ty < tilesY; ty++) {
+        for (uint32_t tx = 0; tx < tilesX; tx++) {
+            Tile* tile = &tiles[ty * tilesX + tx];
+            tile->minX = tx * tileSize;
+            tile->minY = ty * tileSize;
+            tile->maxX = std::min(tile->minX + tileSize, width);
+            tile->maxY = std::min(tile->minY + tileSize, height);
+            tile->first = nullptr;
+            tile->last = nullptr;
+        }
+    }
+}
+
+/* @brief Function adds triangle (in screen space) to bins of all tiles its bounding box touches.
+   Triangles are binned in submission order, so each tile draws them in the same order as before.
+ */
+void GPU::binTriangle(Triangle* t) {
+    glm::vec4* a = &(t->point[0].gl_Position);
+    glm::vec4* b = &(t->point[1].gl_Position);
+    glm::vec4* c = &(t->point[2].gl_Position);
+
+    float minX = std::max(std::floor(std::min(std::min(a->x, b->x), c->x)), 0.f);
+    float minY = std::max(std::floor(std::min(std::min(a->y, b->y), c->y)), 0.f);
+    float maxX = std::min(std::ceil(std::max(std::max(a->x, b->x), c->x)), (float)currFrameBuffer->width);
+    float maxY = std::min(std::ceil(std::max(std::max(a->y, b->y), c->y)), (float)currFrameBuffer->height);
+    if (!(minX < maxX && minY < maxY)) return;
+
+    uint32_t firstX = (uint32_t)minX / tileSize;
+    uint32_t firstY = (uint32_t)minY / tileSize;
+    uint32_t lastX = ((uint32_t)maxX - 1) / tileSize;
+    uint32_t lastY = ((uint32_t)maxY - 1) / tileSize;
+
+    for (uint32_t ty = firstY; ty <= lastY; ty++) {
+        for (uint32_t tx = firstX; tx <= lastX; tx++) {
+            Tile* tile = &tiles[ty * tilesX + tx];
+            if (tile->last == nullptr || tile->last->count == binChunkSize) {
+                BinChunk* chunk = drawArena.allocate<BinChunk>();
+                chunk->count = 0;
+                chunk->next = nullptr;
+                if (tile->last != nullptr) tile->last->next = chunk;
+                else tile->first = chunk;
+                tile->last = chunk;
+            }
+            tile->last->triangles[tile->last->count++] = t;
+        }
+    }
+}
+
+/* @brief Function rasterizes all triangles binned into one tile.
+   Only pixels of this tile are written, so tiles can run in parallel without locking.
+ */
+void GPU::rasterizeTile(Tile* tile) {
+    if (tile->first == nullptr) return;
+    currFrameBuffer->resolve_tile(tile->minX / tileSize, tile->minY / tileSize);
+    for (BinChunk* chunk = tile->first; chunk != nullptr; chunk = chunk->next) {
+        for (uint32_t i = 0; i < chunk->count; i++) createFragments(chunk->triangles[i], tile);
+    }
+}
+
+/* @brief Function returns size bytes aligned to align from the current block,
+   moves to the next kept block or adds a new one when it does not fit.
+ */
+void* GPU::DrawArena::allocate(size_t size, size_t align) {
+    while (block < blocks.size()) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (offset + size <= blocks[block].size()) {
+            used = offset + size;
+            return blocks[block].data() + offset;
+        }
+        block++;
+        used = 0;
+    }
+    blocks.emplace_back(std::max(size, blockBytes));
+    used = size;
+    return blocks[block].data();
+}
+
+/* @brief Function starts worker threads of the pool.
+   @param nof_threads number of workers, the thread calling run() works as well
+ */
+void GPU::WorkerPool::start(uint32_t nof_threads) {
+    uint64_t current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = false;
+        current = generation;
+    }
+    //workers wait for the next run, earlier runs didn't count them in busy
+    for (uint32_t i = 0; i < nof_threads; i++) threads.emplace_back(&WorkerPool::loop, this, current);
+}
+
+/* @brief Function stops and joins all worker threads.
+ */
+void GPU::WorkerPool::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+}
+
+/* @brief Function runs fn(0) .. fn(jobs - 1) on all threads of the pool and waits for them.
+ */
+void GPU::WorkerPool::run(uint32_t jobs, std::function<void(uint32_t)> const& fn) {
+    if (threads.empty() || jobs < 2) {
+        for (uint32_t i = 0; i < jobs; i++) fn(i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = fn;
+        nof_jobs = jobs;
+        next_job = 0;
+        busy = (uint32_t)threads.size();
+        generation++;
+    }
+    wake.notify_all();
+    drain();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+/* @brief Function takes jobs from shared counter until there are none left.
+ */
+void GPU::WorkerPool::drain() {
+    for (uint32_t i = next_job++; i < nof_jobs; i = next_job++) job(i);
+}
+
+/* @brief Main function of worker thread.
+   @param seen generation of the last run before the worker was started
+ */
+void GPU::WorkerPool::loop(uint64_t seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this, seen] { return stop || generation != seen; });
+        if (stop) return;
+        seen = generation;
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (--busy == 0) done.notify_one();
+    }
+}
+
 void GPU::debugTriangles() {
     printf("Width: %d\nHeight: %d\n-----------\n\n", getFramebufferWidth(), getFramebufferHeight());
-    for (Triangle* t : triangles) {
+    for (Triangle& tr : triangles) {
+        Triangle* t = &tr;
         for (int i = 0; i < 3; i++) {
             printf("X: ");
             printf("%f", t->point[i].gl_Position.x);
@@ -8,12 +8,117 @@
 
 #include <student/fwd.hpp>
 #include <vector>
-#include <map>
-#include <list>
+#include <deque>
 #include <math.h>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
 
-using bufferIT = std::map<BufferID, std::vector<uint8_t>>::iterator;
+
+//batched vertex shader works on vertexBatchSize vertices at once, data are in structure of arrays
+//layout (attributes[attribute][component][vertex]), so shader can use SIMD across vertices
+uint32_t const vertexBatchSize = 8;
+struct InVertexBatch {
+    float attributes[maxAttributes][4][vertexBatchSize];
+    uint32_t gl_VertexID[vertexBatchSize];
+    uint32_t gl_InstanceID[vertexBatchSize];
+    uint32_t count;    //number of valid vertices, rest of lanes repeat the last one
+};
+struct OutVertexBatch {
+    float attributes[maxAttributes][4][vertexBatchSize];
+    float gl_Position[4][vertexBatchSize];
+};
+using BatchVertexShader = void(*)(OutVertexBatch&, InVertexBatch const&, Uniforms const&);
+
+//fragment shader writing to several color attachments at once, gl_FragData[i] goes to attachment i
+uint32_t const maxDrawBuffers = 8;
+struct OutFragmentData {
+    glm::vec4 gl_FragData[maxDrawBuffers];
+};
+using FragmentDataShader = void(*)(OutFragmentData&, InFragment const&, Uniforms const&);
+
+using FramebufferID = ObjectID;
+using PresentID = uint64_t;
+
+//one draw of multiDrawIndirect, records are read from buffer (same layout as in OpenGL),
+//first_index is position in index buffer, or first gl_VertexID when vertex puller has no indexing
+struct DrawIndirectCommand {
+    uint32_t count;             //number of vertices
+    uint32_t instance_count;
+    uint32_t first_index;
+    int32_t base_vertex;        //added to indices read from index buffer
+    uint32_t base_instance;     //added to element read by heads with divisor
+};
+
+//depth buffer formats, D16 and D24 store window depth ((z + 1) / 2) as unsigned normalized integer,
+//D24 is kept in lower 24 bits of 32-bit word, D32F stores NDC z as float
+enum class DepthFormat { D16, D24, D32F };
+
+//color buffer formats, RGBA8, RGB565 and RGBA4 store clamped unsigned normalized values
+//(RGB565 and RGBA4 as one 16-bit word with red in highest bits), RGBA16F and RGBA32F store floats unclamped
+enum class ColorFormat { RGBA8, RGB565, RGBA4, RGBA16F, RGBA32F };
+
+//memory layout of color and depth buffer, LINEAR is row by row, MORTON_BLOCKS stores 8x8 blocks
+//row by row with pixels of block in Morton (z-curve) order, so one block is continuous in memory
+enum class FramebufferLayout { LINEAR, MORTON_BLOCKS };
+
+//buffer mapping access, flags can be combined, PERSISTENT mapping may stay mapped while drawing
+//and using setBufferData/getBufferData, other mappings must be unmapped first
+enum class MapAccess : uint32_t { READ = 1, WRITE = 2, READ_WRITE = 3, PERSISTENT = 4 };
+inline MapAccess operator|(MapAccess a, MapAccess b) { return MapAccess(uint32_t(a) | uint32_t(b)); }
+inline bool hasAccess(MapAccess access, MapAccess flag) { return (uint32_t(access) & uint32_t(flag)) != 0; }
+
+//face culling settings
+enum class CullFace { NONE, BACK, FRONT, FRONT_AND_BACK };
+enum class FrontFace { CCW, CW };
+
+/**
+ * @brief This class records commands for GPU::submit.
+ * List does not touch the GPU, so several threads can record their own lists at once.
+ * Opaque draws between two barriers (clear or ordinary draw) may be reordered by submit.
+ */
+struct CommandList {
+    enum class Type { BIND_VERTEX_PULLER, USE_PROGRAM, UNIFORM, CLEAR, DRAW, DRAW_OPAQUE };
+    struct Command {
+        Type type;
+        ObjectID object;          //vertex puller or program
+        uint32_t uniform;         //uniform id
+        uint32_t floats;          //number of floats written to uniform
+        UniformVariable value;    //uniform value, clear color in v4
+        uint32_t nof_vertices;
+        uint32_t nof_instances;
+        float depth;              //distance of opaque draw from camera
+        Command() {
+            type = Type::DRAW;
+            object = emptyID;
+            uniform = 0;
+            floats = 0;
+            nof_vertices = 0;
+            nof_instances = 0;
+            depth = 0.f;
+        }
+    };
+    std::vector<Command> commands;
+
+    void      bindVertexPuller       (VertexPullerID vao);
+    void      useProgram             (ProgramID prg);
+    void      programUniform1f       (ProgramID prg,uint32_t uniformId,float     const&d);
+    void      programUniform2f       (ProgramID prg,uint32_t uniformId,glm::vec2 const&d);
+    void      programUniform3f       (ProgramID prg,uint32_t uniformId,glm::vec3 const&d);
+    void      programUniform4f       (ProgramID prg,uint32_t uniformId,glm::vec4 const&d);
+    void      programUniformMatrix4f (ProgramID prg,uint32_t uniformId,glm::mat4 const&d);
+    void      clear                  (float r,float g,float b,float a);
+    void      drawTriangles          (uint32_t  nofVertices);
+    void      drawTrianglesInstanced (uint32_t  nofVertices,uint32_t nofInstances);
+    void      drawOpaque             (uint32_t  nofVertices,float depth,uint32_t nofInstances = 1);
+    void      reset                  ();
+    Command&  add                    (Type type);
+    void      uniform                (ProgramID prg,uint32_t uniformId,void const* data,uint32_t floats);
+};
 
 /**
  * @brief This class represent software GPU
@@ -25,15 +130,18 @@ class GPU{
 
     //buffer object commands
     BufferID  createBuffer           (uint64_t size);
+    BufferID  createBufferFromFile   (char const* path,uint64_t offset,uint64_t size);
     void      deleteBuffer           (BufferID buffer);
     void      setBufferData          (BufferID buffer,uint64_t offset,uint64_t size,void const* data);
     void      getBufferData          (BufferID buffer,uint64_t offset,uint64_t size,void      * data);
     bool      isBuffer               (BufferID buffer);
+    void*     mapBuffer              (BufferID buffer,uint64_t offset,uint64_t size,MapAccess access);
+    bool      unmapBuffer            (BufferID buffer);
 
     //vertex array object commands (vertex puller)
     ObjectID  createVertexPuller     ();
     void      deleteVertexPuller     (VertexPullerID vao);
-    void      setVertexPullerHead    (VertexPullerID vao,uint32_t head,AttributeType type,uint64_t stride,uint64_t offset,BufferID buffer);
+    void      setVertexPullerHead    (VertexPullerID vao,uint32_t head,AttributeType type,uint64_t stride,uint64_t offset,BufferID buffer,uint32_t divisor = 0);
     void      setVertexPullerIndexing(VertexPullerID vao,IndexType type,BufferID buffer);
     void      enableVertexPullerHead (VertexPullerID vao,uint32_t head);
     void      disableVertexPullerHead(VertexPullerID vao,uint32_t head);
@@ -45,6 +153,8 @@ class GPU{
     ProgramID createProgram          ();
     void      deleteProgram          (ProgramID prg);
     void      attachShaders          (ProgramID prg,VertexShader vs,FragmentShader fs);
+    void      attachBatchVertexShader(ProgramID prg,BatchVertexShader vs);
+    void      attachFragmentDataShader(ProgramID prg,FragmentDataShader fs);
     void      setVS2FSType           (ProgramID prg,uint32_t attrib,AttributeType type);
     void      useProgram             (ProgramID prg);
     bool      isProgram              (ProgramID prg);
@@ -55,26 +165,117 @@ class GPU{
     void      programUniformMatrix4f (ProgramID prg,uint32_t uniformId,glm::mat4 const&d);
 
     //framebuffer functions
-    void      createFramebuffer      (uint32_t width,uint32_t height);
+    void      createFramebuffer      (uint32_t width,uint32_t height,DepthFormat depth = DepthFormat::D32F,ColorFormat color = ColorFormat::RGBA8);
     void      deleteFramebuffer      ();
     void      resizeFramebuffer      (uint32_t width,uint32_t height);
-    uint8_t*  getFramebufferColor    ();
+    uint8_t*  getFramebufferColor    (uint32_t attachment = 0);
     float*    getFramebufferDepth    ();
     uint32_t  getFramebufferWidth    ();
     uint32_t  getFramebufferHeight   ();
+    void      setFramebufferLayout   (FramebufferLayout layout);
+    void      setFramebufferSamples  (uint32_t samples);
+
+    //framebuffer object commands, bound framebuffer object replaces framebuffer in all framebuffer functions
+    FramebufferID createFramebufferObject(uint32_t width,uint32_t height,uint32_t nofColors,ColorFormat const* colors,DepthFormat depth = DepthFormat::D32F);
+    void      deleteFramebufferObject(FramebufferID fbo);
+    void      bindFramebuffer        (FramebufferID fbo);
+    void      unbindFramebuffer      ();
+    bool      isFramebuffer          (FramebufferID fbo);
+
+    //swap chain commands, framebuffer is back buffer, presented frames are read by other threads until released
+    void      setSwapChainLength     (uint32_t nofBuffers);
+    PresentID present                ();
+    uint8_t const* getPresentedColor (PresentID frame,uint32_t attachment = 0);
+    void      releasePresented       (PresentID frame);
 
     //execution commands
     void      clear                  (float r,float g,float b,float a);
+    void      setLazyClear           (bool      enabled);
     void      drawTriangles          (uint32_t  nofVertices);
+    void      drawTrianglesInstanced (uint32_t  nofVertices,uint32_t nofInstances);
+    void      multiDrawIndirect      (BufferID  commands,uint32_t count);
+    void      submit                 (CommandList const& list);
+    void      setThreadCount         (uint32_t  nofThreads);
+    void      setGuardBand           (float     guard);
+    void      setCullFace            (CullFace  face);
+    void      setFrontFace           (FrontFace face);
+    void      setSmallPrimitiveCulling(bool     enabled);
+    struct DrawStats;    //counters of last draw, defined with variables below
+    DrawStats const& getDrawStats    ();
 
     /// \addtogroup gpu_init 00. proměnné, inicializace / deinicializace grafické karty
     /// @{
     /// \todo zde si můžete vytvořit proměnné grafické karty (buffery, programy, ...)
-    //buffers
-    std::map<BufferID, std::vector<uint8_t>> buffers;
-    //variables to help with selecting free ID:
-    uint64_t nextFreeID;
-    std::list<uint64_t> freeIDs;
+    //object table, ID is index of slot (low 32 bits) and generation of slot (high 32 bits),
+    //generation changes when object is deleted, so stale IDs are not found after slot is reused
+    template<typename T>
+    struct SlotMap {
+        struct Slot {
+            T object;
+            uint32_t generation;
+            bool used;
+        };
+        std::deque<Slot> slots;    //deque keeps objects in place when it grows
+        std::vector<uint32_t> free_slots;
+
+        ObjectID create() {
+            uint32_t index;
+            if (free_slots.empty()) {
+                index = (uint32_t)slots.size();
+                slots.push_back(Slot{ T(), 0, false });
+            }
+            else {
+                index = free_slots.back();
+                free_slots.pop_back();
+            }
+            slots[index].used = true;
+            return ((ObjectID)slots[index].generation << 32) | index;
+        }
+        T* find(ObjectID id) {
+            uint32_t index = (uint32_t)id;
+            if (index >= slots.size()) return nullptr;
+            Slot& slot = slots[index];
+            if (!slot.used || slot.generation != (uint32_t)(id >> 32)) return nullptr;
+            return &slot.object;
+        }
+        bool erase(ObjectID id) {
+            T* object = find(id);
+            if (object == nullptr) return false;
+            uint32_t index = (uint32_t)id;
+            *object = T();    //release memory held by deleted object
+            slots[index].used = false;
+            slots[index].generation++;
+            free_slots.push_back(index);
+            return true;
+        }
+    };
+    //buffers, data never change size after creation, so mapped pointer is valid until buffer is deleted
+    struct Buffer {
+        std::vector<uint8_t> data;
+        //read-only mapping of file for buffers from createBufferFromFile (used instead of data),
+        //file is unmapped when last copy of the mapping is released
+        std::shared_ptr<void> file;
+        uint8_t* file_bytes;
+        uint64_t file_size;
+        bool mapped;
+        MapAccess map_access;
+        uint64_t map_offset;
+        uint64_t map_size;
+        Buffer() {
+            file_bytes = nullptr;
+            file_size = 0;
+            mapped = false;
+            map_access = MapAccess::READ;
+            map_offset = 0;
+            map_size = 0;
+        }
+        uint8_t* bytes() { return file ? file_bytes : data.data(); }
+        uint64_t size() const { return file ? file_size : data.size(); }
+        bool read_only() const { return file != nullptr; }
+        //data can not be used by GPU while buffer is mapped without PERSISTENT
+        bool usable() const { return !mapped || hasAccess(map_access, MapAccess::PERSISTENT); }
+    };
+    SlotMap<Buffer> buffers;
     //vertex pullers
     struct Head {
         bool enabled;
@@ -82,11 +283,13 @@ class GPU{
         uint64_t stride;
         uint64_t offset;
         BufferID buffer;
+        uint32_t divisor;    //0 advances per vertex, n advances once every n instances
         Head() {
             enabled = false;
             buffer = emptyID;
             stride = 0;
             offset = 0;
+            divisor = 0;
             type = AttributeType::EMPTY;
         }
     };
@@ -101,18 +304,22 @@ class GPU{
             index_buffer = emptyID;
         }
     };
-    std::map<VertexPullerID, VertexPuller> vertexPullers;
+    SlotMap<VertexPuller> vertexPullers;
     VertexPuller* currVertexPuller;
     //program
     struct Program {
         VertexShader vertex_shader;
+        BatchVertexShader batch_vertex_shader;
         FragmentShader fragment_shader;
+        FragmentDataShader fragment_data_shader;    //used instead of fragment_shader when set
         Uniforms uniforms;
         AttributeType types[maxAttributes];
         Program() {
             vertex_shader = nullptr;
+            batch_vertex_shader = nullptr;
             fragment_shader = nullptr;
-            for (auto type : types) {
+            fragment_data_shader = nullptr;
+            for (auto& type : types) {
                 type = AttributeType::EMPTY;
             }
         }
@@ -121,45 +328,397 @@ class GPU{
             fragment_shader = fs;
         }
     };
-    std::map<ProgramID, Program> programs;
+    SlotMap<Program> programs;
     Program* currProgram;
     //framebuffer
+    //color attachment of framebuffer
+    struct ColorBuffer {
+        std::vector<uint8_t> buffer;
+        ColorFormat format;
+        //packs color to pixel of buffer, selected for format in set_up
+        void (*write)(uint8_t*, size_t, glm::vec4 const&);
+        uint8_t clear_color[16];    //one pixel in format
+        std::vector<uint8_t> readback;    //linear copy of MORTON_BLOCKS buffer
+        ColorBuffer() {
+            format = ColorFormat::RGBA8;
+            write = nullptr;
+            std::fill(clear_color, clear_color + 16, (uint8_t)0);
+        }
+        void set_up(ColorFormat);
+        uint32_t bytes() const {
+            if (format == ColorFormat::RGB565 || format == ColorFormat::RGBA4) return 2;
+            if (format == ColorFormat::RGBA16F) return 8;
+            if (format == ColorFormat::RGBA32F) return 16;
+            return 4;
+        }
+        void fill(size_t begin, size_t count, bool stream);
+        void write_samples(size_t first, uint32_t mask, glm::vec4 const& color);
+    };
+    //multisampling, samples of pixel are stored next to each other (pixel index * samples + sample)
+    static const uint32_t maxSamples = 8;
     //TODO shouldn't be in header, but kinda didn't work outside
     struct FrameBuffer {
         uint32_t width;
         uint32_t height;
-        std::vector<uint8_t>* color_buffer;
-        std::vector<float>* depth_buffer;
+        std::vector<ColorBuffer> colors;
+        std::vector<uint8_t> depth_buffer;
+        DepthFormat depth_format;
+        float depth_quantum;    //depth step of format in NDC (0 for float)
+        FramebufferLayout layout;
+        uint32_t samples;    //1, 4 or 8
         FrameBuffer() {
             width = 0;
             height = 0;
-            color_buffer = nullptr;
-            depth_buffer = nullptr;
+            depth_format = DepthFormat::D32F;
+            depth_quantum = 0.f;
+            layout = FramebufferLayout::LINEAR;
+            samples = 1;
+            blocks_x = 0;
+            blocks_y = 0;
+            clear_depth = 2.f;
+            tiles_x = 0;
+            tiles_y = 0;
         }
-        void FrameBuffer::set_up(uint32_t new_width, uint32_t new_height) {
-            color_buffer = new std::vector<uint8_t>(size_t((uint64_t)new_width * (uint64_t)new_height * 4));
-            depth_buffer = new std::vector<float>(size_t((uint64_t)new_width * (uint64_t)new_height));
+        void set_up(uint32_t new_width, uint32_t new_height, DepthFormat format, uint32_t nof_colors, ColorFormat const* color_formats) {
+            depth_format = format;
+            if (format == DepthFormat::D16) depth_quantum = 2.f / 65535.f;
+            else if (format == DepthFormat::D24) depth_quantum = 2.f / 16777215.f;
+            else depth_quantum = 0.f;
             width = new_width;
             height = new_height;
+            set_up_blocks();
+            colors.resize(nof_colors);
+            for (uint32_t i = 0; i < nof_colors; i++) {
+                colors[i].set_up(color_formats[i]);
+                colors[i].buffer.resize(stored_samples() * colors[i].bytes());
+            }
+            depth_buffer.resize(stored_samples() * depth_bytes());
+        }
+        void set_up_blocks();
+        uint32_t depth_bytes() const {
+            return depth_format == DepthFormat::D16 ? 2 : 4;
+        }
+        //index of pixel in buffers, MORTON_BLOCKS pads buffers to whole blocks
+        size_t pixel_index(uint32_t x, uint32_t y) const {
+            if (layout == FramebufferLayout::LINEAR) return (size_t)y * width + x;
+            uint32_t bx = x & 7;
+            uint32_t by = y & 7;
+            uint32_t morton = (bx & 1) | (by & 1) << 1 | (bx & 2) << 1 | (by & 2) << 2 | (bx & 4) << 2 | (by & 4) << 3;
+            return ((size_t)(y >> 3) * blocks_x + (x >> 3)) * 64 + morton;
+        }
+        size_t stored_pixels() const {
+            if (layout == FramebufferLayout::LINEAR) return (size_t)width * height;
+            return (size_t)blocks_x * blocks_y * 64;
+        }
+        size_t stored_samples() const {
+            return stored_pixels() * samples;
         }
+        void set_layout(FramebufferLayout);
+        bool same_shape(FrameBuffer const&) const;
+        void set_up_like(FrameBuffer const&);
+        void to_linear(std::vector<uint8_t> const&, uint32_t, std::vector<uint8_t>&) const;
+        void from_linear(std::vector<uint8_t> const&, uint32_t, std::vector<uint8_t>&) const;
+        uint8_t* linear_color(uint32_t attachment);
+        void resolve_samples(ColorBuffer&) const;
+        //depth access in format of the buffer, depths are passed as NDC z, index is of sample (pixel * samples + sample)
+        float read_depth(size_t sample) const;
+        bool depth_passes(size_t sample, float z) const;
+        void write_depth(size_t sample, float z);
+        void fill_depth(size_t begin, size_t count, bool stream);
+        std::vector<float> depth_readback;    //float copy of D16/D24 (or multisampled) buffer for getFramebufferDepth
+        //hierarchical z, bounds of depth of every 8x8 block (tightened as block is drawn to)
+        uint32_t blocks_x;
+        uint32_t blocks_y;
+        std::vector<float> hiz_min;
+        std::vector<float> hiz_max;
+        void reset_hiz(float depth);
+        void update_hiz(uint32_t block, float written_min, float covered_max);
+        //clear values (clear color is in each ColorBuffer), with lazy clear tiles still waiting for them are marked in tile_pending
+        float clear_depth;
+        uint32_t tiles_x;
+        uint32_t tiles_y;
+        std::vector<uint8_t> tile_pending;
+        void fill(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, bool stream);
+        void fill_colors(size_t begin, size_t count, bool stream);
+        void resolve_tile(uint32_t tx, uint32_t ty);
+        void resolve();
     };
+    //framebuffer made by createFramebuffer, and framebuffer objects
+    FrameBuffer defaultFrameBuffer;
+    SlotMap<FrameBuffer> framebuffers;
     FrameBuffer* currFrameBuffer;
+    //presented frames, image is swapped with framebuffer on present and stays held until its reader releases it
+    struct SwapImage {
+        FrameBuffer frame;
+        PresentID id;
+        bool held;
+        SwapImage() {
+            id = emptyID;
+            held = false;
+        }
+    };
+    std::vector<SwapImage> swapImages;
+    PresentID nextPresentID;
+    std::mutex swapChainMutex;
+    std::condition_variable swapChainReleased;
+    SwapImage* findPresented(PresentID);
     
     //DrawTriangles
+    //statistics of last draw
+    struct DrawStats {
+        uint64_t vertex_cache_hits;
+        uint64_t vertex_cache_misses;
+        uint64_t culled_view;         //outside view volume (or nothing left after clipping)
+        uint64_t culled_face;         //back (or front) facing
+        uint64_t culled_zero_area;
+        uint64_t culled_small;        //cover no pixel center
+        DrawStats() {
+            vertex_cache_hits = 0;
+            vertex_cache_misses = 0;
+            culled_view = 0;
+            culled_face = 0;
+            culled_zero_area = 0;
+            culled_small = 0;
+        }
+        void add(DrawStats const& other) {
+            vertex_cache_hits += other.vertex_cache_hits;
+            vertex_cache_misses += other.vertex_cache_misses;
+            culled_view += other.culled_view;
+            culled_face += other.culled_face;
+            culled_zero_area += other.culled_zero_area;
+            culled_small += other.culled_small;
+        }
+    };
+    DrawStats drawStats;
+    std::mutex drawStatsMutex;
+    //vertex puller resolved for current draw, raw pointers to data and reader for each type
+    struct CompiledHead {
+        uint8_t const* data;    //buffer data + head offset
+        uint64_t stride;
+        uint32_t attribute;
+        uint32_t components;
+        uint32_t divisor;
+        void (*read)(Attribute&, uint8_t const*);
+    };
+    struct CompiledPuller {
+        uint8_t const* indices;
+        uint32_t (*read_index)(uint8_t const*, uint32_t);
+        CompiledHead heads[maxAttributes];
+        uint32_t nof_heads;
+        CompiledPuller() {
+            indices = nullptr;
+            read_index = nullptr;
+            nof_heads = 0;
+        }
+    };
+    CompiledPuller compiledPuller;
+    void compileVertexPuller();
+    uint32_t fetchIndex(uint32_t);
+    //vertex shaded in one slot of outVertices
+    struct VertexKey {
+        uint32_t id;               //gl_VertexID
+        uint32_t instance;         //gl_InstanceID
+        uint32_t base_instance;
+    };
     InVertex fetchInVertex(uint32_t);
+    InVertex fetchVertex(VertexKey const&);
+    //vertex stage output, vertexRefs[i] is index to outVertices for i-th vertex of draw
+    std::vector<OutVertex> outVertices;
+    std::vector<uint32_t> vertexRefs;
+    //vertices and triangles are processed in chunks of this size by the pool
+    static const uint32_t vertexChunk = 1024;
+    static const uint32_t triangleChunk = 256;
+    //post-transform cache, slot in outVertices for each gl_VertexID (noSlot when not shaded yet)
+    static const uint32_t noSlot = 0xffffffff;
+    std::vector<uint32_t> cacheSlots;
+    //gl_VertexID of every vertex in outVertices
+    std::vector<uint32_t> shadedIDs;
+    //vertices of one draw command, vertexRefs[refs + i] is relative to shaded (first of its shadedIDs)
+    struct DrawRange {
+        uint32_t refs;
+        uint32_t nof_vertices;
+        uint32_t shaded;
+        uint32_t nof_shaded;
+        uint32_t nof_instances;
+        uint32_t base_instance;
+    };
+    std::vector<DrawRange> drawRanges;
+    //instances of draw range drawn by current run of pipeline, in outVertices they start at slot
+    //(nof_shaded slots per instance) and in triangles at triangle (nof_vertices / 3 per instance)
+    struct DrawPiece {
+        uint32_t range;
+        uint32_t first_instance;
+        uint32_t nof_instances;
+        uint32_t slot;
+        uint32_t triangle;
+    };
+    std::vector<DrawPiece> drawPieces;
+    //draws are split into runs of pipeline with about this many triangles, so memory stays bounded
+    static const uint32_t runTriangles = 65536;
+    std::vector<DrawIndirectCommand> indirectCommands;
+    void drawCommands(DrawIndirectCommand const*, uint32_t);
+    //submit of command lists, opaque draws of one segment are sorted by program, vertex puller and depth,
+    //draws with the same state and uniforms then share one drawCommands
+    struct SortedDraw {
+        Program* program;
+        VertexPuller* puller;
+        uint32_t uniforms;        //snapshot in sortedUniforms
+        uint32_t program_rank;    //order of first use of program and vertex puller in segment
+        uint32_t puller_rank;
+        float depth;
+        uint32_t order;           //position in list, keeps equal keys in recorded order
+        uint32_t nof_vertices;
+        uint32_t nof_instances;
+    };
+    std::vector<SortedDraw> sortedDraws;
+    std::vector<Uniforms> sortedUniforms;
+    //uniforms of program as they are after commands walked so far, snapshot is taken at draw when dirty
+    struct PendingUniforms {
+        Program* program;
+        Uniforms uniforms;
+        uint32_t snapshot;
+        bool dirty;
+    };
+    std::vector<PendingUniforms> pendingUniforms;
+    std::vector<Program*> rankedPrograms;
+    std::vector<VertexPuller*> rankedPullers;
+    std::vector<DrawIndirectCommand> sortedCommands;
+    void executeCommand(CommandList::Command const&);
+    void submitOpaque(CommandList::Command const*, uint32_t);
+    PendingUniforms* findPendingUniforms(Program*);
+    void runPipeline(uint32_t, uint32_t);
+    uint32_t findPiece(uint32_t DrawPiece::*, uint32_t);
+    VertexKey slotVertex(uint32_t, uint32_t&);
+    void processVertices(DrawIndirectCommand const&);
+    void shadeVertices(uint32_t, uint32_t);
+    void fetchVertexBatch(InVertexBatch&, VertexKey const*, uint32_t);
+    //edge functions of one triangle, used by coverage kernels
+    struct Edges {
+        float ax, ay, bx, by, cx, cy;
+        float abdelx, abdely, bcdelx, bcdely, cadelx, cadely;
+    };
+    //value linear in screen space, x and y are relative to first vertex of triangle
+    struct Plane {
+        float c;
+        float dx;
+        float dy;
+        float at(float x, float y) const {
+            return c + dx * x + dy * y;
+        }
+    };
     struct Triangle {
         OutVertex point[3];
         bool valid;
+        //triangles made from this one by clipping, in clippedTriangles of its chunk
+        uint32_t clip_first;
+        uint32_t clip_count;
+        //triangle setup, filled once in screen space before rasterization
+        Edges edges;
+        float z_min;                           //depth range of vertices
+        float z_max;
+        Plane inv_w;                           //1/w
+        Plane z_w;                             //z/w
+        Plane attributes[maxAttributes][4];    //attribute components divided by w
         Triangle() {
             valid = true;
+            clip_first = 0;
+            clip_count = 0;
+        }
+    };
+    std::vector<Triangle> triangles;
+    //triangles made by clipping, one array per chunk of triangles (kept between draws)
+    std::vector<std::vector<Triangle>> clippedTriangles;
+    float guardBand;
+    void processTriangles(uint32_t);
+    void clipTriangle(Triangle*, std::vector<Triangle>&);
+    void projectTriangle(Triangle*, DrawStats&);
+    //cull stage
+    CullFace cullFace;
+    FrontFace frontFace;
+    bool smallPrimitiveCulling;
+    bool cullTriangle(Triangle*, DrawStats&);
+    //bump allocator for data living during one draw, reset at the end of draw,
+    //blocks are kept, so draws not bigger than earlier ones allocate no memory
+    struct DrawArena {
+        static const size_t blockBytes = 64 * 1024;
+        std::vector<std::vector<uint8_t>> blocks;
+        size_t block;    //block being filled
+        size_t used;     //bytes used in it
+        DrawArena() {
+            block = 0;
+            used = 0;
+        }
+        void* allocate(size_t size, size_t align);
+        template<typename T>
+        T* allocate() {
+            return (T*)allocate(sizeof(T), alignof(T));
+        }
+        void reset() {
+            block = 0;
+            used = 0;
+        }
+    };
+    DrawArena drawArena;
+    //tiles (triangles are binned into them after screen transform and rasterized in parallel)
+    static const uint32_t tileSize = 64;
+    static const uint32_t blockSize = 8;
+    //bin of tile is list of chunks of triangle pointers allocated from drawArena
+    static const uint32_t binChunkSize = 62;
+    struct BinChunk {
+        Triangle* triangles[binChunkSize];
+        uint32_t count;
+        BinChunk* next;
+    };
+    struct Tile {
+        uint32_t minX;
+        uint32_t minY;
+        uint32_t maxX;
+        uint32_t maxY;
+        BinChunk* first;
+        BinChunk* last;
+    };
+    std::vector<Tile> tiles;
+    bool lazyClear;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    void setUpTiles();
+    void binTriangle(Triangle*);
+    void rasterizeTile(Tile*);
+    void setUpTriangle(Triangle*);
+    void createFragments(Triangle*, Tile*);
+    //returns bit mask of covered pixels (x + i, y) for i < count <= 32
+    using CoverageKernel = uint32_t(*)(Edges const&, float x, float y, uint32_t count);
+    CoverageKernel coverageKernel;
+    bool createFragment(Triangle*, float, float, bool, uint32_t, float&);
+    void interpolate(InFragment*, Triangle*, float);
+
+    //worker threads, tiles (or other jobs) are handed out one by one from shared counter,
+    //so faster threads just take more of them
+    struct WorkerPool {
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::function<void(uint32_t)> job;
+        std::atomic<uint32_t> next_job;
+        uint32_t nof_jobs;
+        uint32_t busy;
+        uint64_t generation;
+        bool stop;
+        WorkerPool() {
+            next_job = 0;
+            nof_jobs = 0;
+            busy = 0;
+            generation = 0;
+            stop = false;
         }
+        void start(uint32_t nof_threads);
+        void finish();
+        void run(uint32_t jobs, std::function<void(uint32_t)> const& fn);
+        void drain();
+        void loop(uint64_t seen);
     };
-    std::list<Triangle*> triangles;
-    void clipPlane(std::list<Triangle*>::iterator it);
-    std::list<OutFragment> outfrags;
-    void createFragments(Triangle*);
-    void createFragment(Triangle*, float, float);
-    void interpolate(InFragment*, Triangle*);
+    WorkerPool pool;
 
     void debugTriangles();
     /// @}